@@ -37,10 +37,15 @@ start:
 	 */
 	mcr	p15, 0, r0, c7, c5, 0
 
-	/* Restrict ICache and DCache to 16KB each. Avoids page colouring. */
+	/* The ICache and DCache run at their full 32KB each; pm colours
+	 * the pages. Restricting them to 16KB each is only kept to compare
+	 * against.
+	 */
+.ifdef CACHE_16KB
 	mrc	p15, 0, r0, c1, c0, 1		@ Auxiliary Control
 	orr	r0, #(1 << 6)			@ CZ bit
 	mcr	p15, 0, r0, c1, c0, 1
+.endif
 
 	/* VA range [0, 0x40000000) is handled by TTBR0.
 	 * VA range [0x40000000, 0x100000000) is handled by TTBR1.
@@ -16,10 +16,10 @@
  */
 
 #include <assert.h>
+#include <barrier.h>
+#include <dma.h>
 #include <io.h>
 #include <mbox.h>
-#include <mmu.h>
-#include <slub.h>
 #include <string.h>
 #include <ioreq.h>
 
@@ -59,24 +59,23 @@ static int mbox_irq_sched(void *p)
 /* Although the IO routines can run at _ctx_proc, the IO chaining requires
  * them to run at _ctx_sched level too. Consider _ctx_sched as the level
  * at which they run.
+ *
+ * The buffers are DMA-coherent, so the VC sees the request once the writes
+ * drain, without any cache maintenance.
  */
 _ctx_sched
 static void mbox_ioctl(struct io_req *ior)
 {
-	uintptr_t pa;
+	uintptr_t bus;
 	int ch;
-	size_t sz;
 
-	sz = 0;
 	ch = 0;
 
 	switch (ior->io.ioctl.cmd) {
 	case MBOX_IOCTL_FB_ALLOC:
-		sz = sizeof(struct mbox_fb_buf);
 		ch = MBOX_CH_FB;
 		break;
 	case MBOX_IOCTL_UART_CLOCK:
-		sz = sizeof(struct mbox_prop_buf);
 		ch = MBOX_CH_PROP;
 		break;
 	default:
@@ -84,36 +83,38 @@ static void mbox_ioctl(struct io_req *ior)
 		break;
 	}
 
-	pa = mmu_va_to_pa(ior->io.ioctl.arg);
-	assert(ALIGNED(pa, 16));
-	pa |= ch;
-
-	mmu_dcache_clean_inv(ior->io.ioctl.arg, sz);
+	bus = dma_coherent_bus(ior->io.ioctl.arg);
+	assert(ALIGNED(bus, 16));
+	bus |= ch;
 
-	barrier();
+	dsb();
 
 	while (readl(&wo->status) & 0x80000000)
 		;
 
 	/* Trigger the IO. */
-	writel(pa, &wo->rw);
+	writel(bus, &wo->rw);
 }
 
 _ctx_proc
 uint32_t mbox_clk_rate_get(enum mbox_clock c)
 {
 	uint32_t rate;
+	uintptr_t bus;
 	struct io_req ior;
 	struct mbox_prop_buf *b;
 
 	assert(c > 0 && c < MBOX_CLK_MAX);
 
-	b = kmalloc(sizeof(*b));
-	memset(b, 0, sizeof(*b));
+	b = dma_alloc_coherent(sizeof(*b), &bus);
+	assert(b);
 	b->sz = sizeof(*b);
+	b->code = 0;
 	b->u.clk_rate.hdr.id = 0x30002;
 	b->u.clk_rate.hdr.sz = 8;
+	b->u.clk_rate.hdr.type = 0;
 	b->u.clk_rate.id = c;
+	b->end = 0;
 
 	memset(&ior, 0, sizeof(ior));
 	ior.type = IOR_TYPE_IOCTL;
@@ -124,11 +125,11 @@ uint32_t mbox_clk_rate_get(enum mbox_clock c)
 	ioq_ior_wait(&ior);
 
 	rate = b->u.clk_rate.rate;
-	kfree(b);
+	dma_free_coherent(b, sizeof(*b));
 	return rate;
 }
 
-/* The caller must ensure 16-byte alignment. */
+/* The buffer must come from dma_alloc_coherent(). */
 _ctx_proc
 int mbox_fb_alloc(const struct mbox_fb_buf *b)
 {
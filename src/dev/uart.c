@@ -84,7 +84,8 @@ void uart_send(char c)
 	writel(c, io_base + UART_DR);
 }
 
-void uart_send_num(uint32_t v)
+/* Without the line break, for the cells of a table. */
+void uart_send_hex(uint32_t v)
 {
 	int i;
 	char str[9];
@@ -102,6 +103,11 @@ void uart_send_num(uint32_t v)
 		for (i = i - 1; i >= 0; --i)
 			uart_send(str[i]);
 	}
+}
+
+void uart_send_num(uint32_t v)
+{
+	uart_send_hex(v);
 	uart_send('\r');
 	uart_send('\n');
 }
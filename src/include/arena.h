@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <types.h>
+
+/* Bump allocations for objects which all die together. The arena grows by
+ * chunks of chunk_sz, a power of two of at least a page, kmalloc()ed from
+ * the fullpage sizes. Objects of more than a quarter chunk get a chunk of
+ * their own. The objects are never freed one by one: arena_reset() gives
+ * back all the chunks but the first, and arena_destroy() all of them. An
+ * align of 0 means 8 bytes. The objects are not zeroed, and the calls are
+ * not serialized.
+ */
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;	/* The current chunk first. */
+	struct arena_chunk *large;	/* A single object each. */
+	uintptr_t p;			/* Within the current chunk. */
+	uintptr_t end;
+	size_t chunk_sz;
+};
+
+void	arena_init(struct arena *a, size_t chunk_sz);
+void	*arena_alloc(struct arena *a, size_t sz, size_t align);
+void	arena_reset(struct arena *a);
+void	arena_destroy(struct arena *a);
+#endif
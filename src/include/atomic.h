@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+#include <barrier.h>
+
+/* Atomic operations on an int, built on LDREX/STREX (ARMv6 onwards). The
+ * operations which return a value are fully ordered, i.e. they are
+ * preceded and followed by a dmb(). The exclusive monitor is cleared on
+ * every exception return, so an interrupted sequence simply retries.
+ */
+
+static inline int atomic_read(const int *v)
+{
+	return *(const volatile int *)v;
+}
+
+static inline int atomic_add_return(int *v, int i)
+{
+	int res, fail;
+
+	dmb();
+	asm volatile("1:	ldrex	%0, [%2]\n\t"
+		     "add	%0, %0, %3\n\t"
+		     "strex	%1, %0, [%2]\n\t"
+		     "teq	%1, #0\n\t"
+		     "bne	1b\n\t"
+		     : "=&r" (res), "=&r" (fail)
+		     : "r" (v), "r" (i)
+		     : "cc", "memory");
+	dmb();
+	return res;
+}
+
+/* Returns the value found at v. The store happens only if it was old. */
+static inline int atomic_cmpxchg(int *v, int old, int new)
+{
+	int res, fail;
+
+	dmb();
+	do {
+		asm volatile("ldrex	%0, [%2]\n\t"
+			     "mov	%1, #0\n\t"
+			     "teq	%0, %3\n\t"
+			     "strexeq	%1, %4, [%2]\n\t"
+			     : "=&r" (res), "=&r" (fail)
+			     : "r" (v), "r" (old), "r" (new)
+			     : "cc", "memory");
+	} while (fail);
+	dmb();
+	return res;
+}
+
+#define atomic_inc_return(v)		atomic_add_return(v, 1)
+#define atomic_dec_return(v)		atomic_add_return(v, -1)
+#endif
@@ -22,14 +22,51 @@
 
 #define BDY_NLEVELS		13
 
+/* BDY_TYPE_BITMAP:
+ * Each level is a busy bitmap (tier 0), topped by summary tiers. A bit in
+ * tier t (t > 0) is set if the corresponding limb in tier t - 1 has at least
+ * one free entry. The top-most tier of a level is a single limb. With 32-bit
+ * limbs, 4 tiers can track up to 1M blocks per level. The map is a separate
+ * region of bdy_map_size() bytes.
+ *
+ * BDY_TYPE_FLIST:
+ * Per-order doubly-linked free lists, threaded through the struct page of
+ * the leader of each free block. The map is the struct page array covering
+ * the n units, and bdy_map_size() is 0.
+ */
+#define BDY_NTIERS		4
+
+enum bdy_type {
+	BDY_TYPE_BITMAP,
+	BDY_TYPE_FLIST
+};
+
+/* nfree counts, for each level, the free blocks which are not part of a
+ * larger free block.
+ */
 struct bdy {
+	enum bdy_type type;
 	int nbits[BDY_NLEVELS];
-	int nbits_until[BDY_NLEVELS];
+	int nfree[BDY_NLEVELS];
+	union {
+		struct {
+			int ntiers[BDY_NLEVELS];
+			int off[BDY_NLEVELS][BDY_NTIERS];	/* In limbs. */
+		} bm;
+		struct {
+			uint32_t mask;		/* Orders with free blocks. */
+			int head[BDY_NLEVELS];
+		} fl;
+	} u;
 	void *map;
 };
 
-size_t	bdy_map_size(int n);
-void	bdy_init(struct bdy *b, void *map, int n);
-int	bdy_alloc(struct bdy *b, int level, int *out);
-int	bdy_free(struct bdy *b, int level, int pos);
+size_t	bdy_map_size(enum bdy_type type, int n);
+void	bdy_init(struct bdy *b, enum bdy_type type, void *map, int n);
+int	bdy_alloc(struct bdy *b, int level, int n, int *out);
+int	bdy_free(struct bdy *b, int level, int n, const int *pos);
+int	bdy_reserve(struct bdy *b, int level, int pos);
+int	bdy_alloc_colour(struct bdy *b, int mask, int colour, int n,
+			 int *out);
+char	bdy_is_free(const struct bdy *b, int pos);
 #endif
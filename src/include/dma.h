@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DMA_H_
+#define _DMA_H_
+
+#include <types.h>
+
+/* Buffers shared with the VideoCore and the DMA engines. They come from a
+ * pool mapped uncached, so that neither the CPU nor the device needs any
+ * cache maintenance per request. *bus receives the VideoCore bus address
+ * of the buffer. The buffers are aligned to at least 32 bytes, and sz is
+ * given back to the free. A buffer is at most 128KB; a larger sz, or an
+ * exhausted pool, gets NULL.
+ */
+void		*dma_alloc_coherent(size_t sz, uintptr_t *bus);
+void		dma_free_coherent(void *va, size_t sz);
+uintptr_t	dma_coherent_bus(const void *va);
+#endif
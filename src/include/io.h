@@ -27,6 +27,21 @@ extern void * const io_base;
 extern void * const ctrl_base;
 #endif /* QRPI2 */
 
+/* The VideoCore sees the ARM physical RAM through a bus alias. Use the
+ * alias which bypasses the VC L2 cache on RPi2, and the L2 coherent one
+ * on RPi.
+ */
+#ifdef QRPI2
+#define IO_BUS_RAM_ALIAS	0xc0000000
+#else
+#define IO_BUS_RAM_ALIAS	0x40000000
+#endif /* QRPI2 */
+
+static inline uint32_t io_bus_addr(uintptr_t pa)
+{
+	return pa | IO_BUS_RAM_ALIAS;
+}
+
 static inline uint32_t readl(const void *addr)
 {
 	return *(const volatile uint32_t *)addr;
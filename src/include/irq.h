@@ -45,6 +45,7 @@ enum irq_sched {
 	IRQ_SCHED_UART,
 	IRQ_SCHED_SDHC,
 	IRQ_SCHED_MBOX,
+	IRQ_SCHED_SLUB,
 	IRQ_SCHED_SCHEDULE,		/* Should be the last. */
 	IRQ_SCHED_MAX
 };
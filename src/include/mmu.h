@@ -29,6 +29,14 @@
 #define PAGE_SIZE		(1ull << PAGE_SIZE_SZ)
 #define PAGE_SIZE_MASK		bits_mask(PAGE_SIZE_SZ)
 
+/* With the L1 caches at their full 32KB and 4 ways, a way spans 8KB, and
+ * VA[12] indexes the caches along with the page offset. All the cacheable
+ * mappings of a page must agree on that bit, which is the page's colour.
+ */
+#define CACHE_COLOUR_POS	PAGE_SIZE_SZ
+#define CACHE_COLOUR_SZ		1
+#define CACHE_NCOLOURS		(1 << CACHE_COLOUR_SZ)
+
 #define SECTION_SIZE_SZ		20
 #define SECTION_SIZE		(1ull << SECTION_SIZE_SZ)
 #define SECTION_SIZE_MASK	bits_mask(SECTION_SIZE_SZ)
@@ -28,6 +28,7 @@ struct mutex {
 
 void	mutex_init(struct mutex *m);
 void	mutex_lock(struct mutex *m);
+int	mutex_trylock(struct mutex *m);
 void	mutex_unlock(struct mutex *m);
 
 #endif
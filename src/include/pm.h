@@ -18,6 +18,8 @@
 #ifndef _PM_H_
 #define _PM_H_
 
+#include <mmu.h>
+
 /* PM_UNIT_MAX must equal BDY_NLEVELS. */
 enum pm_alloc_units {
 	PM_UNIT_4KB,
@@ -41,15 +43,13 @@ enum pm_alloc_units {
 #define PM_UNIT_SECTION		PM_UNIT_1MB
 #define PM_UNIT_SUPER_SECTION	PM_UNIT_16MB
 
-/* If the struct is for a page which is a subordinate page to
- * either a large page, a section or a super section, then all
- * fields (except the TYPE bit) on such a subordinate are free
- * and can be used by the leader page as an extension.
- *
- * Whether a page is a leader can be known by the physical address
- * and the type.
+/* Blocks are compound: only the struct page of the leader of an
+ * allocated block is initialised, and carries PGF_HEAD. The fields of the
+ * subordinate (tail) pages hold stale values, and are free for pm to use.
+ * pm_ram_get_page() resolves a tail to its leader by probing the aligned
+ * positions below it, and caches the result in the tail.
  *
- * The busy/free bit for the page is stored in the buddy bitmap.
+ * The busy/free bit for the page is stored in the buddy.
  */
 
 enum pm_page_usage {
@@ -71,17 +71,112 @@ enum pm_page_usage {
 #define PGF_SLUB_LSIZE_POS		5
 #define PGF_SLUB_LSIZE_SZ		5
 
+/* PGF_HEAD is set on the leader of an allocated block, and cleared when
+ * the block is freed. PGF_TAIL marks a tail page whose u0.lead caches the
+ * pfn of a leader; the cache is only trusted if that leader has PGF_HEAD,
+ * and its block covers the tail.
+ */
+#define PGF_HEAD_POS			10
+#define PGF_HEAD_SZ			1
+#define PGF_TAIL_POS			11
+#define PGF_TAIL_SZ			1
+
+/* Only valid while the page leads a free block within a BDY_TYPE_FLIST
+ * buddy. PGF_UNIT then holds the order of the free block, and u0.next
+ * the index of the next free block of that order. The engine owns all
+ * the fields of such a page.
+ */
+#define PGF_BDY_PREV_POS		12
+#define PGF_BDY_PREV_SZ			19
+#define PGF_BDY_FREE_POS		31
+#define PGF_BDY_FREE_SZ			1
+
+/* pm_ram_alloc flags. */
+
+/* The allocated memory must be zeroed. PM_UNIT_PAGE allocations are
+ * served from a pool of pages which the idle thread zeroes in the
+ * background; the rest are zeroed at allocation.
+ */
+#define PMA_ZERO_POS			0
+#define PMA_ZERO_SZ			1
+
+/* A PM_UNIT_PAGE allocation must be of the colour in PMA_COLOUR. The larger
+ * units are naturally aligned, and so already match any VA of the same
+ * alignment.
+ */
+#define PMA_COLOURED_POS		1
+#define PMA_COLOURED_SZ			1
+#define PMA_COLOUR_POS			2
+#define PMA_COLOUR_SZ			CACHE_COLOUR_SZ
+
 struct page {
 	uint32_t flags;
 	union {
 		int ref;
 		void *va;		/* struct slab. */
+		int next;		/* bdy free list. */
+		int lead;		/* PGF_TAIL. */
 	} u0;
 };
 
+/* The owner of movable PGF_USE_NORMAL blocks. To move a block, move()
+ * must stop its users from writing to the block at old_pa, copy it to
+ * new_pa with pm_ram_copy(), and switch the users over to new_pa. pm then
+ * moves the struct pages along, and frees the block at old_pa. Called
+ * with the pm lock held; must not call into pm except for pm_ram_copy().
+ * A non-zero return leaves the block where it is.
+ */
+struct pm_mover {
+	int (*move)(struct pm_mover *mv, enum pm_alloc_units unit,
+		    uintptr_t old_pa, uintptr_t new_pa);
+};
+
+/* A cache which holds on to free pages. shrink() gives back what it can
+ * spare, when the free memory runs low. It is called from the compaction
+ * thread without any pm lock held, and returns the number of pages freed.
+ */
+struct pm_shrinker {
+	struct list_head entry;
+	int (*shrink)(struct pm_shrinker *s);
+};
+
+/* The free blocks of bdy_ram, by unit, not counting the contiguous memory
+ * area. free is in pages. frag is the fragmentation index of each unit.
+ * nalloc and nfreed count the blocks, of both areas, allocated and freed
+ * since boot; nfail counts the failed pm_ram_alloc() calls.
+ */
+struct pm_ram_stats {
+	int nfree[PM_UNIT_MAX];
+	int frag[PM_UNIT_MAX];
+	uint32_t nalloc[PM_UNIT_MAX];
+	uint32_t nfreed[PM_UNIT_MAX];
+	uint32_t nfail;
+	uint32_t free;
+};
+
+/* The pm_ram_alloc flags for pages of the colour of va. */
+static inline int pm_colour_of(const void *va)
+{
+	return bits_on(PMA_COLOURED) |
+		bits_set(PMA_COLOUR, bits_get((uintptr_t)va, CACHE_COLOUR));
+}
+
 int		pm_ram_alloc(enum pm_alloc_units unit, enum pm_page_usage use,
-			     int n, uintptr_t *pa);
+			     int flags, int n, uintptr_t *pa);
+int		pm_ram_alloc_movable(enum pm_alloc_units unit, int flags,
+				     int n, uintptr_t *pa,
+				     struct pm_mover *mv);
+void		pm_ram_copy(uintptr_t dst, uintptr_t src,
+			    enum pm_alloc_units unit);
+int		pm_cma_alloc(int n, void **va, uintptr_t *bus);
+int		pm_cma_free(int n, void *va);
 int		pm_ram_free(enum pm_alloc_units unit, enum pm_page_usage use,
 			    int n, const uintptr_t *pa);
 struct page	*pm_ram_get_page(uintptr_t pa);
+void		pm_page_get(struct page *pg);
+int		pm_page_put(struct page *pg);
+int		pm_ram_prezero();
+void		pm_ram_stats(struct pm_ram_stats *st);
+void		pm_ram_stats_dump();
+void		pm_shrinker_register(struct pm_shrinker *s);
 #endif
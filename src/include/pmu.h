@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PMU_H_
+#define _PMU_H_
+
+#include <types.h>
+
+/* The performance monitor counts the L1 ICache and DCache misses, and the
+ * cycles, between pmu_start() and pmu_stop().
+ */
+struct pmu_counts {
+	uint32_t icache_miss;
+	uint32_t dcache_miss;
+	uint32_t cycles;
+};
+
+#ifdef QRPI2
+
+/* ARMv7 PMU. Event counters 0 and 1, and the cycle counter. */
+#define PMU_EV_ICACHE_MISS		0x01	/* L1 ICache refill. */
+#define PMU_EV_DCACHE_MISS		0x03	/* L1 DCache refill. */
+
+#define PMCR_E_POS			0
+#define PMCR_P_POS			1
+#define PMCR_C_POS			2
+#define PMCR_E_SZ			1
+#define PMCR_P_SZ			1
+#define PMCR_C_SZ			1
+
+#define PMU_CNT_MASK			((1u << 31) | 3)
+
+static inline void pmu_set_event(int i, uint32_t ev)
+{
+	asm volatile("mcr	p15, 0, %0, c9, c12, 5\n\t"	/* PMSELR */
+		     "mcr	p15, 0, %1, c9, c13, 1\n\t"	/* PMXEVTYPER */
+		     : : "r" (i), "r" (ev));
+}
+
+static inline uint32_t pmu_read_event(int i)
+{
+	uint32_t v;
+
+	asm volatile("mcr	p15, 0, %1, c9, c12, 5\n\t"	/* PMSELR */
+		     "mrc	p15, 0, %0, c9, c13, 2\n\t"	/* PMXEVCNTR */
+		     : "=r" (v) : "r" (i));
+	return v;
+}
+
+static inline void pmu_start()
+{
+	uint32_t v;
+
+	pmu_set_event(0, PMU_EV_ICACHE_MISS);
+	pmu_set_event(1, PMU_EV_DCACHE_MISS);
+
+	v  = bits_on(PMCR_E);
+	v |= bits_on(PMCR_P);
+	v |= bits_on(PMCR_C);
+	asm volatile("mcr	p15, 0, %0, c9, c12, 1\n\t"	/* PMCNTENSET */
+		     "mcr	p15, 0, %1, c9, c12, 0\n\t"	/* PMCR */
+		     : : "r" (PMU_CNT_MASK), "r" (v) : "memory");
+}
+
+static inline void pmu_stop(struct pmu_counts *c)
+{
+	asm volatile("mcr	p15, 0, %0, c9, c12, 2\n\t"	/* PMCNTENCLR */
+		     : : "r" (PMU_CNT_MASK) : "memory");
+
+	c->icache_miss = pmu_read_event(0);
+	c->dcache_miss = pmu_read_event(1);
+	asm volatile("mrc	p15, 0, %0, c9, c13, 0\n\t"	/* PMCCNTR */
+		     : "=r" (c->cycles));
+}
+
+#else
+
+/* ARM1176 PMU, in the system control coprocessor. PMNC selects the events
+ * of the two counters.
+ */
+#define PMU_EV_ICACHE_MISS		0x00
+#define PMU_EV_DCACHE_MISS		0x0b
+
+#define PMNC_E_POS			0
+#define PMNC_P_POS			1
+#define PMNC_C_POS			2
+#define PMNC_EVT1_POS			12
+#define PMNC_EVT0_POS			20
+#define PMNC_E_SZ			1
+#define PMNC_P_SZ			1
+#define PMNC_C_SZ			1
+#define PMNC_EVT1_SZ			8
+#define PMNC_EVT0_SZ			8
+
+static inline void pmu_start()
+{
+	uint32_t v;
+
+	v  = bits_set(PMNC_EVT0, PMU_EV_ICACHE_MISS);
+	v |= bits_set(PMNC_EVT1, PMU_EV_DCACHE_MISS);
+	v |= bits_on(PMNC_E);
+	v |= bits_on(PMNC_P);
+	v |= bits_on(PMNC_C);
+	asm volatile("mcr	p15, 0, %0, c15, c12, 0\n\t"	/* PMNC */
+		     : : "r" (v) : "memory");
+}
+
+static inline void pmu_stop(struct pmu_counts *c)
+{
+	uint32_t v;
+
+	asm volatile("mrc	p15, 0, %0, c15, c12, 0\n\t"	/* PMNC */
+		     : "=r" (v) : : "memory");
+	v &= bits_off(PMNC_E);
+	asm volatile("mcr	p15, 0, %0, c15, c12, 0\n\t"
+		     : : "r" (v));
+
+	asm volatile("mrc	p15, 0, %0, c15, c12, 1\n\t"	/* CCNT */
+		     "mrc	p15, 0, %1, c15, c12, 2\n\t"	/* PMN0 */
+		     "mrc	p15, 0, %2, c15, c12, 3\n\t"	/* PMN1 */
+		     : "=r" (c->cycles), "=r" (c->icache_miss),
+		       "=r" (c->dcache_miss));
+}
+
+#endif /* QRPI2 */
+#endif
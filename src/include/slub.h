@@ -21,11 +21,46 @@
 #include <types.h>
 
 /* Slub supports allocations of sizes
- * 8,16,32,64,128,256,512,1K,2K,4K,
+ * 8,16,24,32,48,64,96,128,192,256,384,512,768,1K,1.5K,2K,4K,
  * 8K,16K,32K,64K,128K,256K,512K,1M,2M,4M,
  * 8M,16M,32M,64M
+ * An object of a 1.5x size (24,48,...,1.5K) is aligned only to the largest
+ * power of two that divides the size, and to no more than a cache line, as
+ * those slabs are coloured.
  */
 
 void	*kmalloc(size_t sz);
 void	kfree(void *p);
+
+/* Allocate n objects of the size sz, or free n objects of any sizes, into
+ * or from the array objs. The objects of a subpage size are carved, or
+ * returned, under a single acquisition of the size's lock.
+ */
+void	kmalloc_bulk(size_t sz, int n, void **objs);
+void	kfree_bulk(int n, void **objs);
+
+/* Print the counters of each size over the UART. */
+void	slub_stats_dump();
+
+/* For _ctx_soft and _ctx_sched. Does not sleep; takes from a small reserve
+ * of each size up to 2K, and returns NULL when that reserve is empty, or
+ * for a larger sz.
+ */
+void	*kmalloc_atomic(size_t sz);
+
+/* Caches of objects of a single type. The objects are sized and aligned
+ * exactly. The constructor, if any, runs once on each object when its slab
+ * is created; the objects must be freed back in their constructed state.
+ * Without a constructor, an object is zeroed only the first time it is
+ * handed out from a new slab; after that it comes back as it was freed.
+ * kmem_cache_alloc() returns NULL once the VMA_SLUB area or the RAM runs
+ * out.
+ */
+struct kmem_cache;
+typedef void (*kmem_ctor)(void *p);
+
+struct kmem_cache	*kmem_cache_create(const char *name, size_t sz,
+					   size_t align, kmem_ctor ctor);
+void			*kmem_cache_alloc(struct kmem_cache *c);
+void			kmem_cache_free(struct kmem_cache *c, void *p);
 #endif
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SYS_BDY_H_
+#define _SYS_BDY_H_
+
+/* Internal buddy API. Implemented by the BDY_TYPE_FLIST engine. */
+
+#include <bdy.h>
+
+void	bdyfl_init(struct bdy *b, void *map, int n);
+int	bdyfl_alloc(struct bdy *b, int level, int n, int *out);
+int	bdyfl_free(struct bdy *b, int level, int n, const int *pos);
+int	bdyfl_reserve(struct bdy *b, int level, int pos);
+int	bdyfl_alloc_colour(struct bdy *b, int mask, int colour, int n,
+			   int *out);
+char	bdyfl_is_unit_free(const struct bdy *b, int pos);
+#endif
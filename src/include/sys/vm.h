@@ -18,23 +18,14 @@
 #ifndef _SYS_VM_H_
 #define _SYS_VM_H_
 
-#include <list.h>
-
-#define VSF_AP_POS		 0
-#define VSF_AP_SZ		 3
-#define VSF_MT_POS		 3
-#define VSF_MT_SZ		 5
-#define VSF_NPAGES_POS		12
-#define VSF_NPAGES_SZ		20
-
 /* For now, the vm calls support allocation and deallocation within the
- * two 128MB region starting at vm_slub_start.
+ * 128MB regions starting at vm_slub_start and vm_slub_section_start.
  */
 #define VM_AREA_SIZE	(128 * 1024 * 1024)
 
-struct vm_seg {
-	struct list_head entry;
-	void *start;
-	uint32_t flags;
-};
+/* The slabs slub maps at the end of the vm_slub area during boot, one per
+ * subpage size, each a block of VM_SLUB_BOOT_UNIT.
+ */
+#define VM_SLUB_NBOOT		16
+#define VM_SLUB_BOOT_UNIT	VM_UNIT_16KB
 #endif
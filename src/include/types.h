@@ -90,6 +90,17 @@ static inline uintptr_t _bits_off(uintptr_t pos, size_t sz)
 #define bits_on(flag)	_bits_on(flag ## _POS, flag ## _SZ)
 #define bits_off(flag)	_bits_off(flag ## _POS, flag ## _SZ)
 
+/* v must be non-zero. Both compile down to the CLZ instruction. */
+static inline int bits_clz(uint32_t v)
+{
+	return __builtin_clz(v);
+}
+
+static inline int bits_ctz(uint32_t v)
+{
+	return __builtin_ctz(v);
+}
+
 #define ARRAY_SIZE(a)		sizeof(a)/sizeof((a)[0])
 
 struct list_head {
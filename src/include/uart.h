@@ -21,6 +21,7 @@
 #include <types.h>
 
 void	uart_send(char c);
+void	uart_send_hex(uint32_t v);
 void	uart_send_num(uint32_t v);
 void	uart_send_str(const char *s);
 #endif
@@ -20,6 +20,7 @@
 
 enum vm_area {
 	VMA_SLUB,
+	VMA_SLUB_SECTION,
 	VMA_MAX
 };
 
@@ -37,6 +38,8 @@ enum vm_alloc_units {
 	VM_UNIT_4MB,
 	VM_UNIT_8MB,
 	VM_UNIT_16MB,
+	VM_UNIT_32MB,
+	VM_UNIT_64MB,
 	VM_UNIT_MAX
 };
 
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arena.h>
+#include <assert.h>
+#include <mmu.h>
+#include <slub.h>
+
+#define ARENA_MIN_ALIGN		8
+
+/* An object is large past chunk_sz >> ARENA_LARGE_SZ. */
+#define ARENA_LARGE_SZ		2
+
+struct arena_chunk {
+	struct arena_chunk *next;
+};
+
+static void arena_free_chunks(struct arena_chunk *c)
+{
+	struct arena_chunk *n;
+
+	for (; c; c = n) {
+		n = c->next;
+		kfree(c);
+	}
+}
+
+void arena_init(struct arena *a, size_t chunk_sz)
+{
+	assert((chunk_sz & (chunk_sz - 1)) == 0 && chunk_sz >= PAGE_SIZE);
+	a->chunks = NULL;
+	a->large = NULL;
+	a->p = 0;
+	a->end = 0;
+	a->chunk_sz = chunk_sz;
+}
+
+/* A subpage object is aligned only as far as its slab colour allows, so a
+ * large object asks for align - 1 more bytes and is aligned by hand past
+ * the header of its chunk.
+ */
+_ctx_proc
+void *arena_alloc(struct arena *a, size_t sz, size_t align)
+{
+	uintptr_t p;
+	struct arena_chunk *c;
+
+	if (align < ARENA_MIN_ALIGN)
+		align = ARENA_MIN_ALIGN;
+	assert((align & (align - 1)) == 0 && align <= PAGE_SIZE);
+	assert(sz);
+
+	if (sz > a->chunk_sz >> ARENA_LARGE_SZ) {
+		c = kmalloc(sizeof(*c) + align - 1 + sz);
+		assert(c);
+		c->next = a->large;
+		a->large = c;
+		return (void *)ALIGN_UP((uintptr_t)(c + 1), align);
+	}
+
+	p = ALIGN_UP(a->p, align);
+	if (p + sz > a->end) {
+		c = kmalloc(a->chunk_sz);
+		assert(c);
+		c->next = a->chunks;
+		a->chunks = c;
+		a->end = (uintptr_t)c + a->chunk_sz;
+		p = ALIGN_UP((uintptr_t)(c + 1), align);
+	}
+	a->p = p + sz;
+	return (void *)p;
+}
+
+/* The first chunk, at the end of the list, is kept for reuse. */
+_ctx_proc
+void arena_reset(struct arena *a)
+{
+	struct arena_chunk *c, *n;
+
+	arena_free_chunks(a->large);
+	a->large = NULL;
+
+	c = a->chunks;
+	if (c == NULL)
+		return;
+
+	for (; c->next; c = n) {
+		n = c->next;
+		kfree(c);
+	}
+	a->chunks = c;
+	a->p = (uintptr_t)(c + 1);
+	a->end = (uintptr_t)c + a->chunk_sz;
+}
+
+_ctx_proc
+void arena_destroy(struct arena *a)
+{
+	arena_free_chunks(a->large);
+	arena_free_chunks(a->chunks);
+	arena_init(a, a->chunk_sz);
+}
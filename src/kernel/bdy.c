@@ -15,58 +15,134 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <assert.h>
 #include <bdy.h>
 #include <string.h>
 
-size_t bdy_map_size(int n)
+#include <sys/bdy.h>
+
+#define BDY_LIMB(pos)		((pos) >> 5)
+#define BDY_BIT(pos)		((pos) & 0x1f)
+#define BDY_NLIMBS(n)		(((n) + 0x1f) >> 5)
+typedef uint32_t limb_t;
+
+#define BDY_LIMB_FULL		(~(limb_t)0)
+
+/* Each tier of each level starts at a limb boundary, so that the searches
+ * can work on whole limbs. Returns the number of limbs needed by the map.
+ *
+ * A level only tracks the blocks which lie entirely within the n units. A
+ * level without any such block still gets a single, always busy, limb.
+ */
+static int bdy_layout(struct bdy *b, int n)
 {
-	int i, t;
+	int i, t, nl, off;
 
-	t = 0;
+	off = 0;
 	for (i = 0; i < BDY_NLEVELS; ++i) {
-		t += n;
-		if (n & 1)
-			++n;
+		b->nbits[i] = n;
+
+		nl = n;
+		for (t = 0; t < BDY_NTIERS; ++t) {
+			b->u.bm.off[i][t] = off;
+			nl = BDY_NLIMBS(nl);
+			if (nl == 0)
+				nl = 1;
+			off += nl;
+			if (nl == 1)
+				break;
+		}
+		assert(t < BDY_NTIERS);
+		b->u.bm.ntiers[i] = t + 1;
+
 		n >>= 1;
 	}
+	return off;
+}
 
-	return ALIGN_UP(t, 8) >> 3;
+static limb_t *bdy_limb(const struct bdy *b, int level, int tier, int l)
+{
+	limb_t *map;
+
+	map = b->map;
+	return &map[b->u.bm.off[level][tier] + l];
+}
+
+size_t bdy_map_size(enum bdy_type type, int n)
+{
+	struct bdy b;
+
+	if (type == BDY_TYPE_FLIST)
+		return 0;
+	return bdy_layout(&b, n) * sizeof(limb_t);
 }
 
-void bdy_init(struct bdy *b, void *map, int n)
+void bdy_init(struct bdy *b, enum bdy_type type, void *map, int n)
 {
-	int i, t;
+	int i, t, nb;
 
 	memset(b, 0, sizeof(*b));
-	memset(map, 0, bdy_map_size(n));
+	b->type = type;
+	if (type == BDY_TYPE_FLIST) {
+		bdyfl_init(b, map, n);
+		return;
+	}
 
+	memset(map, 0, bdy_layout(b, n) * sizeof(limb_t));
 	b->map = map;
 
-	t = 0;
 	for (i = 0; i < BDY_NLEVELS; ++i) {
-		b->nbits[i] = n;
-		b->nbits_until[i] = t;
-		t += n;
-		if (n & 1)
-			++n;
-		n >>= 1;
+		/* The blocks without a parent are the free blocks. */
+		nb = b->nbits[i];
+		if (i < BDY_NLEVELS - 1)
+			b->nfree[i] = nb - 2 * b->nbits[i + 1];
+		else
+			b->nfree[i] = nb;
+
+		/* The bits beyond nbits in the last limb are kept busy. */
+		if (BDY_BIT(nb) || nb == 0)
+			*bdy_limb(b, i, 0, BDY_LIMB(nb)) =
+				BDY_LIMB_FULL << BDY_BIT(nb);
+
+		/* Every limb of every tier has free entries. */
+		for (t = 1; t < b->u.bm.ntiers[i]; ++t) {
+			nb = BDY_NLIMBS(nb);
+			memset(bdy_limb(b, i, t, 0), 0xff, (nb >> 5) << 2);
+			if (BDY_BIT(nb))
+				*bdy_limb(b, i, t, BDY_LIMB(nb)) =
+					~(BDY_LIMB_FULL << BDY_BIT(nb));
+		}
 	}
 }
 
-#define BDY_LIMB(pos)		((pos) >> 5)
-#define BDY_BIT(pos)		((pos) & 0x1f)
-typedef uint32_t limb_t;
+/* Called when the limb l of the busy bitmap transitions between full and
+ * not full. Walks up the summary tiers until a limb whose emptiness does not
+ * change.
+ */
+static void bdy_sum_update(struct bdy *b, int level, int l)
+{
+	int t, free;
+	limb_t *p, v;
+
+	free = *bdy_limb(b, level, 0, l) != BDY_LIMB_FULL;
+	for (t = 1; t < b->u.bm.ntiers[level]; ++t) {
+		p = bdy_limb(b, level, t, BDY_LIMB(l));
+		v = *p;
+		if (free)
+			*p |= 1u << BDY_BIT(l);
+		else
+			*p &= ~(1u << BDY_BIT(l));
+
+		if ((v != 0) == (*p != 0))
+			break;
+		free = *p != 0;
+		l = BDY_LIMB(l);
+	}
+}
 
 static char bdy_is_set(const struct bdy *b, int level, int pos)
 {
-	int l, p;
-	limb_t *map;
-
-	map = b->map;
-	pos += b->nbits_until[level];
-	l = BDY_LIMB(pos);
-	p = BDY_BIT(pos);
-	if (map[l] & (1 << p))
+	if (*bdy_limb(b, level, 0, BDY_LIMB(pos)) & (1u << BDY_BIT(pos)))
 		return 1;
 	else
 		return 0;
@@ -74,79 +150,245 @@ static char bdy_is_set(const struct bdy *b, int level, int pos)
 
 static void bdy_clr(struct bdy *b, int level, int pos)
 {
-	int l, p;
-	limb_t *map;
+	limb_t *p, v;
 
-	map = b->map;
-	pos += b->nbits_until[level];
-	l = BDY_LIMB(pos);
-	p = BDY_BIT(pos);
-	map[l] &= ~(1 << p);
+	p = bdy_limb(b, level, 0, BDY_LIMB(pos));
+	v = *p;
+	*p &= ~(1u << BDY_BIT(pos));
+	if (v == BDY_LIMB_FULL)
+		bdy_sum_update(b, level, BDY_LIMB(pos));
 }
 
 static void bdy_set(struct bdy *b, int level, int pos)
 {
-	int l, p;
-	limb_t *map;
+	limb_t *p;
 
-	map = b->map;
-	pos += b->nbits_until[level];
-	l = BDY_LIMB(pos);
-	p = BDY_BIT(pos);
-	map[l] |= 1 << p;
+	p = bdy_limb(b, level, 0, BDY_LIMB(pos));
+	*p |= 1u << BDY_BIT(pos);
+	if (*p == BDY_LIMB_FULL)
+		bdy_sum_update(b, level, BDY_LIMB(pos));
 }
 
-int bdy_alloc(struct bdy *b, int level, int *out)
+/* Set or clear n bits starting at pos, a limb at a time. The range is
+ * clipped to the level.
+ */
+static void bdy_set_range(struct bdy *b, int level, int pos, int n, char on)
 {
-	int i, j, k, pos;
+	int l, e;
+	limb_t *p, v, mask;
+
+	e = pos + n;
+	if (e > b->nbits[level])
+		e = b->nbits[level];
 
-	for (i = 0; i < b->nbits[level]; ++i)
-		if (!bdy_is_set(b, level, i))
+	while (pos < e) {
+		l = BDY_LIMB(pos);
+		mask = BDY_LIMB_FULL << BDY_BIT(pos);
+		if (BDY_LIMB(e - 1) == l)
+			mask &= BDY_LIMB_FULL >> (31 - BDY_BIT(e - 1));
+
+		p = bdy_limb(b, level, 0, l);
+		v = *p;
+		if (on)
+			*p |= mask;
+		else
+			*p &= ~mask;
+
+		if ((v == BDY_LIMB_FULL) != (*p == BDY_LIMB_FULL))
+			bdy_sum_update(b, level, l);
+		pos = (l + 1) << 5;
+	}
+}
+
+static int bdy_nlimbs(const struct bdy *b, int level, int tier)
+{
+	if (tier == b->u.bm.ntiers[level] - 1)
+		return 1;
+	return b->u.bm.off[level][tier + 1] - b->u.bm.off[level][tier];
+}
+
+/* Find the first free block at or after pos. Climb the summary tiers until
+ * a limb with a candidate to the right of the current position, then
+ * descend, picking the first limb with free entries at each tier. Costs one
+ * limb load and one CTZ per tier visited.
+ */
+static int bdy_next(const struct bdy *b, int level, int pos)
+{
+	int t, l;
+	limb_t v;
+
+	for (t = 0; t < b->u.bm.ntiers[level]; ++t) {
+		l = BDY_LIMB(pos);
+		if (l >= bdy_nlimbs(b, level, t))
+			return -1;
+
+		v = *bdy_limb(b, level, t, l);
+		if (t == 0)
+			v = ~v;
+		v &= BDY_LIMB_FULL << BDY_BIT(pos);
+		if (v)
 			break;
+		pos = l + 1;
+	}
 
-	if (i == b->nbits[level])
+	if (t == b->u.bm.ntiers[level])
 		return -1;
 
-	pos = j = i;
+	pos = (l << 5) + bits_ctz(v);
+	for (; t > 0; --t) {
+		v = *bdy_limb(b, level, t - 1, pos);
+		if (t == 1)
+			v = ~v;
+		pos = (pos << 5) + bits_ctz(v);
+	}
+	return pos;
+}
 
-	/* Self and Ancestor bits. */
-	for (i = level; i < BDY_NLEVELS; ++i, j >>= 1)
+static void bdy_mark(struct bdy *b, int level, int pos)
+{
+	int i, j;
+
+	/* Self and Ancestor bits. The ancestors of a busy block are
+	 * already busy. The ancestors of a block at the end of the units
+	 * may not exist. Splitting a free ancestor leaves the sibling on
+	 * the way down free.
+	 */
+	bdy_set(b, level, pos);
+	for (i = level + 1, j = pos >> 1; i < BDY_NLEVELS; ++i, j >>= 1) {
+		if (j >= b->nbits[i])
+			break;
+		if (bdy_is_set(b, i, j))
+			break;
 		bdy_set(b, i, j);
+		++b->nfree[i - 1];
+	}
+
+	/* The free block the block was carved from. */
+	--b->nfree[i - 1];
 
 	j = pos;
 	/* Descendant bits. */
 	for (i = level - 1; i >= 0; --i) {
 		j <<= 1;
-		for (k = 0; k < 1 << (level - i); ++k) {
-			if (j + k >= b->nbits[i])
-				break;
-			bdy_set(b, i, j + k);
-		}
+		bdy_set_range(b, i, j, 1 << (level - i), 1);
+	}
+}
+
+/* All or nothing. Marking a block busy only touches its ancestors and its
+ * descendants, never the other blocks of its level. So, the n blocks are
+ * collected in a single left-to-right sweep before any of them is marked,
+ * and a failure needs no unwinding. The result is the same as that of n
+ * single allocations.
+ */
+int bdy_alloc(struct bdy *b, int level, int n, int *out)
+{
+	int i, pos;
+
+	assert(n > 0 && out);
+	if (b->type == BDY_TYPE_FLIST)
+		return bdyfl_alloc(b, level, n, out);
+
+	pos = -1;
+	for (i = 0; i < n; ++i) {
+		pos = bdy_next(b, level, pos + 1);
+		if (pos < 0)
+			return -1;
+		assert(pos < b->nbits[level]);
+		out[i] = pos;
+	}
+
+	for (i = 0; i < n; ++i)
+		bdy_mark(b, level, out[i]);
+	return 0;
+}
+
+/* Level 0 only. Like bdy_next(), but only returns the units whose
+ * (pos & mask) matches the colour, i.e. whose bits are set in cm.
+ */
+static int bdy_next_colour(const struct bdy *b, int pos, limb_t cm)
+{
+	int l;
+	limb_t v;
+
+	while (1) {
+		pos = bdy_next(b, 0, pos);
+		if (pos < 0)
+			return -1;
+
+		l = BDY_LIMB(pos);
+		v = ~*bdy_limb(b, 0, 0, l) & cm;
+		v &= BDY_LIMB_FULL << BDY_BIT(pos);
+		if (v)
+			return (l << 5) + bits_ctz(v);
+		pos = (l + 1) << 5;
 	}
+}
+
+/* Allocate n units, all of the same colour, i.e. with (pos & mask) ==
+ * colour. mask + 1 is a power of two no larger than a limb, so the colour
+ * pattern of a limb is the same for all limbs. All or nothing, as with
+ * bdy_alloc().
+ */
+int bdy_alloc_colour(struct bdy *b, int mask, int colour, int n, int *out)
+{
+	int i, pos;
+	limb_t cm;
+
+	assert(n > 0 && out);
+	assert(mask >= 0 && mask < 32 && ((mask + 1) & mask) == 0);
+	assert((colour & ~mask) == 0);
+	if (b->type == BDY_TYPE_FLIST)
+		return bdyfl_alloc_colour(b, mask, colour, n, out);
+
+	cm = 0;
+	for (i = colour; i < 32; i += mask + 1)
+		cm |= (limb_t)1 << i;
+
+	pos = -1;
+	for (i = 0; i < n; ++i) {
+		pos = bdy_next_colour(b, pos + 1, cm);
+		if (pos < 0)
+			return -1;
+		assert(pos < b->nbits[0]);
+		out[i] = pos;
+	}
+
+	for (i = 0; i < n; ++i)
+		bdy_mark(b, 0, out[i]);
+	return 0;
+}
+
+/* Mark a specific free block busy. A clear bit implies that the whole block
+ * is free.
+ */
+int bdy_reserve(struct bdy *b, int level, int pos)
+{
+	if (b->type == BDY_TYPE_FLIST)
+		return bdyfl_reserve(b, level, pos);
 
-	if (out)
-		*out = pos;
+	assert(pos < b->nbits[level]);
+	if (bdy_is_set(b, level, pos))
+		return -1;
+	bdy_mark(b, level, pos);
 	return 0;
 }
 
-int bdy_free(struct bdy *b, int level, int pos)
+static void bdy_unmark(struct bdy *b, int level, int pos)
 {
-	int i, j, k, s;
+	int i, j, s;
 
 	j = pos;
 	/* Descendant bits. */
 	for (i = level - 1; i >= 0; --i) {
 		j <<= 1;
-		for (k = 0; k < 1 << (level - i); ++k) {
-			if (j + k >= b->nbits[i])
-				break;
-			bdy_clr(b, i, j + k);
-		}
+		bdy_set_range(b, i, j, 1 << (level - i), 0);
 	}
 
 	j = pos;
 	/* Self and Ancestor bits. */
 	for (i = level; i < BDY_NLEVELS; ++i, j >>= 1) {
+		if (j >= b->nbits[i])
+			break;
 		bdy_clr(b, i, j);
 
 		/* Check the sibling. */
@@ -160,9 +402,39 @@ int bdy_free(struct bdy *b, int level, int pos)
 			break;
 
 		/* Else, the sibling either does not exist, or
-		 * is clear. Continue clearing the parent.
+		 * is clear. Continue clearing the parent. A clear
+		 * sibling merges into it.
 		 */
+		if (s < b->nbits[i] && i < BDY_NLEVELS - 1)
+			--b->nfree[i];
 	}
-	return 0;
+
+	/* The block at the last level cleared. */
+	if (i == BDY_NLEVELS || j >= b->nbits[i])
+		--i;
+	++b->nfree[i];
 }
 
+/* Whether the unit pos is free. */
+char bdy_is_free(const struct bdy *b, int pos)
+{
+	if (b->type == BDY_TYPE_FLIST)
+		return bdyfl_is_unit_free(b, pos);
+
+	assert(pos < b->nbits[0]);
+	return !bdy_is_set(b, 0, pos);
+}
+
+/* Freeing does not search; each block costs O(levels). */
+int bdy_free(struct bdy *b, int level, int n, const int *pos)
+{
+	int i;
+
+	assert(n > 0 && pos);
+	if (b->type == BDY_TYPE_FLIST)
+		return bdyfl_free(b, level, n, pos);
+
+	for (i = 0; i < n; ++i)
+		bdy_unmark(b, level, pos[i]);
+	return 0;
+}
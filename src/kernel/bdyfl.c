@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <bdy.h>
+#include <pm.h>
+
+#include <sys/bdy.h>
+
+/* BDY_TYPE_FLIST engine. The free blocks of each order are kept on a
+ * circular doubly-linked list of page indices. Allocation pops the head of
+ * the smallest non-empty order and splits it down, keeping the lower half.
+ * Freeing coalesces with the buddy as long as the buddy heads a free block
+ * of the same order.
+ */
+
+#define BDYFL_NIL		((int)bits_mask(PGF_BDY_PREV_SZ))
+
+static struct page *bdyfl_page(const struct bdy *b, int pos)
+{
+	struct page *pages;
+
+	pages = b->map;
+	return &pages[pos];
+}
+
+static int bdyfl_prev(const struct bdy *b, int pos)
+{
+	return bits_get(bdyfl_page(b, pos)->flags, PGF_BDY_PREV);
+}
+
+static void bdyfl_set_prev(struct bdy *b, int pos, int prev)
+{
+	struct page *pg;
+
+	pg = bdyfl_page(b, pos);
+	pg->flags &= bits_off(PGF_BDY_PREV);
+	pg->flags |= bits_set(PGF_BDY_PREV, prev);
+}
+
+static char bdyfl_is_free(const struct bdy *b, int order, int pos)
+{
+	const struct page *pg;
+
+	pg = bdyfl_page(b, pos);
+	return bits_get(pg->flags, PGF_BDY_FREE) &&
+		(int)bits_get(pg->flags, PGF_UNIT) == order;
+}
+
+/* Insert at the head, or at the tail if tail is set. */
+static void bdyfl_add(struct bdy *b, int order, int pos, char tail)
+{
+	int h, t;
+	struct page *pg;
+
+	pg = bdyfl_page(b, pos);
+	pg->flags  = bits_set(PGF_UNIT, order);
+	pg->flags |= bits_on(PGF_BDY_FREE);
+
+	++b->nfree[order];
+	h = b->u.fl.head[order];
+	if (h == BDYFL_NIL) {
+		pg->u0.next = pos;
+		bdyfl_set_prev(b, pos, pos);
+		b->u.fl.head[order] = pos;
+		b->u.fl.mask |= 1u << order;
+		return;
+	}
+
+	t = bdyfl_prev(b, h);
+	pg->u0.next = h;
+	bdyfl_set_prev(b, pos, t);
+	bdyfl_page(b, t)->u0.next = pos;
+	bdyfl_set_prev(b, h, pos);
+	if (!tail)
+		b->u.fl.head[order] = pos;
+}
+
+static void bdyfl_del(struct bdy *b, int order, int pos)
+{
+	int n, p;
+	struct page *pg;
+
+	--b->nfree[order];
+	pg = bdyfl_page(b, pos);
+	n = pg->u0.next;
+	p = bdyfl_prev(b, pos);
+
+	if (n == pos) {
+		b->u.fl.head[order] = BDYFL_NIL;
+		b->u.fl.mask &= ~(1u << order);
+	} else {
+		bdyfl_page(b, p)->u0.next = n;
+		bdyfl_set_prev(b, n, p);
+		if (b->u.fl.head[order] == pos)
+			b->u.fl.head[order] = n;
+	}
+
+	pg->flags = 0;
+	pg->u0.next = 0;
+}
+
+/* Carve [0, n) into the largest naturally aligned blocks. The lists are
+ * built in ascending order of address, so that, like the bitmap engine,
+ * the early boot allocations come from the bottom of the RAM.
+ */
+void bdyfl_init(struct bdy *b, void *map, int n)
+{
+	int i, pos, order;
+
+	assert(n > 0 && n < BDYFL_NIL);
+
+	b->map = map;
+	b->nbits[0] = n;
+	b->u.fl.mask = 0;
+	for (i = 0; i < BDY_NLEVELS; ++i)
+		b->u.fl.head[i] = BDYFL_NIL;
+
+	for (pos = 0; pos < n; pos += 1 << order) {
+		order = BDY_NLEVELS - 1;
+		if (pos)
+			order = bits_ctz(pos) < order ? bits_ctz(pos) : order;
+		while (pos + (1 << order) > n)
+			--order;
+		bdyfl_add(b, order, pos, 1);
+	}
+}
+
+static int bdyfl_alloc_one(struct bdy *b, int level, int *out)
+{
+	int pos, order;
+	uint32_t mask;
+
+	mask = b->u.fl.mask >> level;
+	if (mask == 0)
+		return -1;
+
+	order = level + bits_ctz(mask);
+	pos = b->u.fl.head[order];
+	bdyfl_del(b, order, pos);
+
+	/* Split, returning the upper halves to the lists. */
+	while (order > level) {
+		--order;
+		bdyfl_add(b, order, pos + (1 << order), 0);
+	}
+
+	*out = pos >> level;
+	return 0;
+}
+
+/* Find the free block containing the requested one, and split it down,
+ * returning the halves which do not contain the requested block.
+ */
+int bdyfl_reserve(struct bdy *b, int level, int pos)
+{
+	int p, order;
+
+	pos <<= level;
+	assert(pos + (1 << level) <= b->nbits[0]);
+
+	for (order = level; order < BDY_NLEVELS; ++order) {
+		p = pos & ~((1 << order) - 1);
+		if (bdyfl_is_free(b, order, p))
+			break;
+	}
+
+	if (order == BDY_NLEVELS)
+		return -1;
+
+	bdyfl_del(b, order, p);
+	while (order > level) {
+		--order;
+		if (pos & (1 << order)) {
+			bdyfl_add(b, order, p, 0);
+			p += 1 << order;
+		} else {
+			bdyfl_add(b, order, p + (1 << order), 0);
+		}
+	}
+	return 0;
+}
+
+/* Walk up to limit blocks of the order, or all of them if limit is
+ * negative, for one holding a unit of the colour. Returns the unit. Below
+ * log2(mask + 1), a block only holds some of the colours.
+ */
+static int bdyfl_scan_colour(const struct bdy *b, int order, int mask,
+			     int colour, int limit)
+{
+	int h, pos, low;
+
+	low = (1 << order) - 1;
+	mask &= ~low;
+	h = b->u.fl.head[order];
+	if (h == BDYFL_NIL)
+		return -1;
+
+	pos = h;
+	do {
+		if ((pos & mask) == (colour & mask))
+			return pos + (colour & low);
+		pos = bdyfl_page(b, pos)->u0.next;
+	} while (pos != h && --limit);
+	return -1;
+}
+
+/* Look at a few of the small blocks for a unit of the colour, before
+ * splitting a block large enough to hold every colour. Only walk the whole
+ * of the small lists when there is no such block.
+ */
+#define BDYFL_COLOUR_PROBES	8
+
+static int bdyfl_alloc_colour_one(struct bdy *b, int mask, int colour,
+				  int *out)
+{
+	int nc, pos, order, ret;
+	uint32_t fmask;
+
+	nc = mask ? 32 - bits_clz(mask) : 0;
+	for (order = 0; order < nc; ++order) {
+		pos = bdyfl_scan_colour(b, order, mask, colour,
+					BDYFL_COLOUR_PROBES);
+		if (pos >= 0)
+			goto found;
+	}
+
+	fmask = b->u.fl.mask >> nc;
+	if (fmask) {
+		pos = b->u.fl.head[nc + bits_ctz(fmask)] + colour;
+		goto found;
+	}
+
+	for (order = 0; order < nc; ++order) {
+		pos = bdyfl_scan_colour(b, order, mask, colour, -1);
+		if (pos >= 0)
+			goto found;
+	}
+	return -1;
+found:
+	ret = bdyfl_reserve(b, 0, pos);
+	assert(ret == 0);
+	*out = pos;
+	return 0;
+}
+
+/* Whether the unit pos lies within a free block. */
+char bdyfl_is_unit_free(const struct bdy *b, int pos)
+{
+	int order;
+
+	assert(pos < b->nbits[0]);
+	for (order = 0; order < BDY_NLEVELS; ++order)
+		if (bdyfl_is_free(b, order, pos & ~((1 << order) - 1)))
+			return 1;
+	return 0;
+}
+
+static void bdyfl_free_one(struct bdy *b, int level, int pos)
+{
+	int order, buddy;
+
+	pos <<= level;
+	assert(pos + (1 << level) <= b->nbits[0]);
+	assert(!bits_get(bdyfl_page(b, pos)->flags, PGF_BDY_FREE));
+
+	for (order = level; order < BDY_NLEVELS - 1; ++order) {
+		buddy = pos ^ (1 << order);
+		if (buddy + (1 << order) > b->nbits[0])
+			break;
+		if (!bdyfl_is_free(b, order, buddy))
+			break;
+		bdyfl_del(b, order, buddy);
+		if (buddy < pos)
+			pos = buddy;
+	}
+
+	bdyfl_add(b, order, pos, 0);
+}
+
+/* Each allocation is a pop, so there is no search to share between the n
+ * blocks. A failure returns the blocks taken so far.
+ */
+int bdyfl_alloc(struct bdy *b, int level, int n, int *out)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (bdyfl_alloc_one(b, level, &out[i]))
+			break;
+	}
+
+	if (i == n)
+		return 0;
+
+	for (i = i - 1; i >= 0; --i)
+		bdyfl_free_one(b, level, out[i]);
+	return -1;
+}
+
+int bdyfl_alloc_colour(struct bdy *b, int mask, int colour, int n, int *out)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (bdyfl_alloc_colour_one(b, mask, colour, &out[i]))
+			break;
+	}
+
+	if (i == n)
+		return 0;
+
+	for (i = i - 1; i >= 0; --i)
+		bdyfl_free_one(b, 0, out[i]);
+	return -1;
+}
+
+int bdyfl_free(struct bdy *b, int level, int n, const int *pos)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		bdyfl_free_one(b, level, pos[i]);
+	return 0;
+}
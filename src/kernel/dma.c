@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2018 Amol Surati
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <bdy.h>
+#include <dma.h>
+#include <io.h>
+#include <mmu.h>
+#include <mutex.h>
+#include <pm.h>
+#include <slub.h>
+#include <vm.h>
+
+/* The pool is a section of the contiguous memory area, which pm maps
+ * MT_NRM_IO_NC. A buddy over the pool hands out blocks from 32 bytes, the
+ * alignment of the DMA control blocks, up to 128KB. Without the contiguous
+ * memory area, the pool is a section of the RAM, mapped likewise at a
+ * section of VA taken from the VMA_SLUB_SECTION area.
+ */
+#define DMA_POOL_NSECTIONS	1
+#define DMA_BLK_SZ		5
+#define DMA_POOL_NBLKS		((DMA_POOL_NSECTIONS << SECTION_SIZE_SZ) >> \
+				 DMA_BLK_SZ)
+
+static struct bdy dma_bdy;
+static struct mutex dma_lock;
+static void *dma_va;
+static uintptr_t dma_bus;
+
+/* The buddy level of the smallest block that holds sz bytes, or -1 past
+ * the largest block.
+ */
+static int dma_level(size_t sz)
+{
+	int level;
+
+	assert(sz);
+	sz = (sz - 1) >> DMA_BLK_SZ;
+	level = sz ? 32 - bits_clz(sz) : 0;
+	if (level >= BDY_NLEVELS)
+		return -1;
+	return level;
+}
+
+_ctx_proc
+void *dma_alloc_coherent(size_t sz, uintptr_t *bus)
+{
+	int level, pos, ret;
+	uintptr_t off;
+
+	level = dma_level(sz);
+	if (level < 0)
+		return NULL;
+
+	mutex_lock(&dma_lock);
+	ret = bdy_alloc(&dma_bdy, level, 1, &pos);
+	mutex_unlock(&dma_lock);
+	if (ret)
+		return NULL;
+
+	off = (uintptr_t)pos << (level + DMA_BLK_SZ);
+	*bus = dma_bus + off;
+	return dma_va + off;
+}
+
+_ctx_proc
+void dma_free_coherent(void *va, size_t sz)
+{
+	int level, pos, ret;
+	uintptr_t off;
+
+	level = dma_level(sz);
+	assert(level >= 0);
+	off = va - dma_va;
+	assert(off < (DMA_POOL_NSECTIONS << SECTION_SIZE_SZ));
+	assert(ALIGNED(off, 1 << (level + DMA_BLK_SZ)));
+	pos = off >> (level + DMA_BLK_SZ);
+
+	mutex_lock(&dma_lock);
+	ret = bdy_free(&dma_bdy, level, 1, &pos);
+	mutex_unlock(&dma_lock);
+	assert(ret == 0);
+}
+
+uintptr_t dma_coherent_bus(const void *va)
+{
+	uintptr_t off;
+
+	off = va - dma_va;
+	assert(off < (DMA_POOL_NSECTIONS << SECTION_SIZE_SZ));
+	return dma_bus + off;
+}
+
+/* The lines which the earlier users of the section left in the cache are
+ * cleaned and invalidated through a cacheable map, before the uncached map
+ * goes up.
+ */
+_ctx_init
+static void dma_pool_ram_alloc()
+{
+	int ret;
+	uintptr_t pa;
+	struct mmu_map_req r;
+
+	assert(DMA_POOL_NSECTIONS == 1);
+	ret = pm_ram_alloc(PM_UNIT_SECTION, PGF_USE_NORMAL, 0, 1, &pa);
+	assert(ret == 0);
+	ret = vm_alloc(VMA_SLUB_SECTION, VM_UNIT_SECTION, 1, &dma_va);
+	assert(ret == 0);
+
+	r.va_start = dma_va;
+	r.pa_start = pa;
+	r.n = 1;
+	r.mt = MT_NRM_IO_WBA;
+	r.ap = AP_SRW;
+	r.mu = MAP_UNIT_SECTION;
+	r.flags  = bits_on(MMR_XN);
+	r.flags |= bits_on(MMR_AF);
+
+	ret = mmu_map(&r);
+	assert(ret == 0);
+	mmu_dcache_clean_inv(dma_va, SECTION_SIZE);
+	ret = mmu_unmap(&r);
+	assert(ret == 0);
+
+	r.mt = MT_NRM_IO_NC;
+	ret = mmu_map(&r);
+	assert(ret == 0);
+	dma_bus = io_bus_addr(pa);
+}
+
+_ctx_init
+void dma_init()
+{
+	int ret;
+	void *map;
+
+	ret = pm_cma_alloc(DMA_POOL_NSECTIONS, &dma_va, &dma_bus);
+	if (ret)
+		dma_pool_ram_alloc();
+
+	map = kmalloc(bdy_map_size(BDY_TYPE_BITMAP, DMA_POOL_NBLKS));
+	assert(map);
+	bdy_init(&dma_bdy, BDY_TYPE_BITMAP, map, DMA_POOL_NBLKS);
+	mutex_init(&dma_lock);
+}
@@ -57,4 +57,5 @@ excpt_irq_addr:
 	bl	excpt_irq
 
 	pop	{r0-r3, r12, lr}
+	clrex				@ Fail an interrupted STREX
 	rfeia	sp!			@ Undo srsdb
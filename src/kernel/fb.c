@@ -16,6 +16,7 @@
  */
 
 #include <assert.h>
+#include <dma.h>
 #include <mmu.h>
 
 #include <mbox.h>
@@ -27,25 +28,35 @@
 #include <sched.h>
 #include <slub.h>
 
-static struct mbox_fb_buf b __attribute__ ((aligned(16)));
+static struct mbox_fb_buf b;
 void *fb;
 const struct mbox_fb_buf *fbi = &b;
 
 void fb_init()
 {
 	int ret;
+	uintptr_t bus;
 	struct mmu_map_req r;
+	struct mbox_fb_buf *db;
 	size_t sz;
 
-	memset(&b, 0, sizeof(b));
+	/* The request goes through an uncached buffer; fbi keeps a cached
+	 * copy of the response.
+	 */
+	db = dma_alloc_coherent(sizeof(*db), &bus);
+	assert(db);
+	memset(db, 0, sizeof(*db));
 
-	b.phy_width = b.virt_width = 1024;
-	b.phy_height = b.virt_height = 768;
-	b.depth = 24;
+	db->phy_width = db->virt_width = 1024;
+	db->phy_height = db->virt_height = 768;
+	db->depth = 24;
 
-	ret = mbox_fb_alloc(&b);
+	ret = mbox_fb_alloc(db);
 	assert(ret == 0);
 
+	b = *db;
+	dma_free_coherent(db, sizeof(*db));
+
 	/* Keep the size SECTION-aligned for ease in mapping. */
 	sz = ALIGN_UP(b.sz, SECTION_SIZE);
 	sz >>= SECTION_SIZE_SZ;
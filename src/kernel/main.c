@@ -21,15 +21,22 @@
 #include <irq.h>
 #include <fb.h>
 #include <list.h>
+#include <mmu.h>
+#include <pm.h>
+#include <pmu.h>
 #include <string.h>
 #include <uart.h>
+#include <vm.h>
 
 void sched_current_init();
 void sched_init();
 void mmu_init();
 void pm_init(uint32_t ram, uint32_t ramsz);
+void pm_compact_init();
 void io_init();
 void slub_init();
+void slub_shrinker_init();
+void slub_rsv_init();
 void vm_init();
 void excpt_init();
 void intc_init();
@@ -37,6 +44,7 @@ void irq_init();
 void ioreq_init();
 void timer_init();
 void timer_start();
+void dma_init();
 void mbox_init();
 void fb_init();
 void uart_init();
@@ -100,6 +108,141 @@ static int display_thread(void *p)
 
 #endif
 
+#ifdef PMU_BENCH
+
+/* Walk a 24KB working set, which fits the 32KB DCache but not a 16KB one,
+ * and report the cache misses over the UART. Build with each CACHE_KB to
+ * compare.
+ */
+#define PMU_BENCH_NPAGES	6
+#define PMU_BENCH_NLOOPS	64
+
+static void pmu_bench()
+{
+	int i, j, k, n, step;
+	uint32_t sum;
+	volatile uint32_t *p[PMU_BENCH_NPAGES];
+	struct pmu_counts c;
+
+	for (i = 0; i < PMU_BENCH_NPAGES; ++i) {
+		p[i] = kmalloc(PAGE_SIZE);
+		assert(p[i]);
+	}
+
+	/* Read a word per cache line. The first loop warms the caches up. */
+	n = PAGE_SIZE >> 2;
+	step = CACHE_LINE_SIZE >> 2;
+	sum = 0;
+	for (k = 0; k <= PMU_BENCH_NLOOPS; ++k) {
+		if (k == 1)
+			pmu_start();
+		for (i = 0; i < PMU_BENCH_NPAGES; ++i)
+			for (j = 0; j < n; j += step)
+				sum += p[i][j];
+	}
+	pmu_stop(&c);
+
+	uart_send_str("pmu dcache miss:");
+	uart_send_num(c.dcache_miss);
+	uart_send_str("pmu icache miss:");
+	uart_send_num(c.icache_miss);
+	uart_send_str("pmu cycles:");
+	uart_send_num(c.cycles);
+	(void)sum;
+
+	for (i = 0; i < PMU_BENCH_NPAGES; ++i)
+		kfree((void *)p[i]);
+}
+
+/* Walk a list of 768-byte objects, as the scheduler walks its run queue,
+ * touching the list entry of each alone. The objects fill 8 slabs, whose
+ * entries fall into the same L1 sets, 8 deep, unless the slabs are
+ * coloured. Build with each SLAB_COLOUR to compare.
+ */
+#define PMU_BENCH_OBJ_SZ	768
+#define PMU_BENCH_NOBJS		(8 * 21)
+
+static void pmu_bench_list()
+{
+	int i, k;
+	volatile uint32_t n;
+	struct list_head h, *e;
+	struct list_head *objs[PMU_BENCH_NOBJS];
+	struct pmu_counts c;
+
+	init_list_head(&h);
+	for (i = 0; i < PMU_BENCH_NOBJS; ++i) {
+		objs[i] = kmalloc(PMU_BENCH_OBJ_SZ);
+		assert(objs[i]);
+		list_add_tail(objs[i], &h);
+	}
+
+	/* The first loop warms the caches up. */
+	n = 0;
+	for (k = 0; k <= PMU_BENCH_NLOOPS; ++k) {
+		if (k == 1)
+			pmu_start();
+		list_for_each(e, &h)
+			++n;
+	}
+	pmu_stop(&c);
+
+	uart_send_str("pmu list dcache miss:");
+	uart_send_num(c.dcache_miss);
+	uart_send_str("pmu list cycles:");
+	uart_send_num(c.cycles);
+	(void)n;
+
+	for (i = 0; i < PMU_BENCH_NOBJS; ++i)
+		kfree(objs[i]);
+}
+
+/* Reserve, then give back, PMU_BENCH_NSEGS page-sized VA blocks, one call
+ * each, with all of them live at the end of the reservations. Reports the
+ * cycles of each sweep.
+ */
+#define PMU_BENCH_NSEGS		4096
+
+static void pmu_bench_vm()
+{
+	int i, ret;
+	void **va;
+	struct pmu_counts c;
+
+	va = kmalloc(PMU_BENCH_NSEGS * sizeof(*va));
+	assert(va);
+
+	pmu_start();
+	for (i = 0; i < PMU_BENCH_NSEGS; ++i) {
+		ret = vm_alloc(VMA_SLUB, VM_UNIT_PAGE, 1, &va[i]);
+		assert(ret == 0);
+	}
+	pmu_stop(&c);
+	uart_send_str("pmu vm_alloc cycles:");
+	uart_send_num(c.cycles);
+
+	pmu_start();
+	for (i = 0; i < PMU_BENCH_NSEGS; ++i) {
+		ret = vm_free(VMA_SLUB, VM_UNIT_PAGE, 1,
+			      (const void **)&va[i]);
+		assert(ret == 0);
+	}
+	pmu_stop(&c);
+	uart_send_str("pmu vm_free cycles:");
+	uart_send_num(c.cycles);
+
+	kfree(va);
+}
+
+#endif
+
+#ifdef STATS_DUMP
+
+/* Print the allocator counters every STATS_DUMP_TICKS seconds. */
+#define STATS_DUMP_TICKS	64
+
+#endif
+
 static int ticker_thread(void *p)
 {
 	int ticks = 0;
@@ -107,6 +250,12 @@ static int ticker_thread(void *p)
 	(void)p;
 
 	while (1) {
+#ifdef STATS_DUMP
+		if ((ticks & (STATS_DUMP_TICKS - 1)) == 0) {
+			slub_stats_dump();
+			pm_ram_stats_dump();
+		}
+#endif
 		uart_send_num(ticks);
 		msleep(1000);
 		++ticks;
@@ -130,13 +279,17 @@ void kmain()
 	io_init();
 	pm_init(ram, ramsz);
 	slub_init();
+	slub_shrinker_init();
 	vm_init();
 	excpt_init();
 	intc_init();
 	irq_init();
 	sched_init();
+	slub_rsv_init();
+	pm_compact_init();
 	ioreq_init();
 	timer_init();
+	dma_init();
 	mbox_init();
 
 	/* Enable IRQs once hard and soft IRQs are setup. */
@@ -153,6 +306,12 @@ void kmain()
 #endif
 	uart_init();
 
+#ifdef PMU_BENCH
+	pmu_bench();
+	pmu_bench_list();
+	pmu_bench_vm();
+#endif
+
 #ifdef QRPI2
 	(void)display_thread;
 	sched_thread_create(display_thread, NULL);
@@ -20,6 +20,8 @@
 #include <mmu.h>
 #include <string.h>
 #include <lock.h>
+#include <mutex.h>
+#include <sched.h>
 #include <barrier.h>
 #include <slub.h>
 #include <uart.h>
@@ -36,6 +38,28 @@ extern char k_pt_start;
  */
 static struct lock k_pd_lock;
 
+/* PTs set aside for mmu_map_pages(), so that it neither drops k_pd_lock nor
+ * calls into slub. mmu_map() tops the reserve up, outside the lock, until
+ * it holds the number of empty PDEs the request touches, if any, plus
+ * MMU_PT_RSV_LOW. The spare PTs serve the maps that slub itself makes
+ * while it grows the PT size for the refill; those maps, made by the
+ * filler, only take from the reserve. The PTs are kept zeroed and
+ * cleaned. Guarded by k_pd_lock. One thread fills at a time, under
+ * fill_lock.
+ */
+#define MMU_PT_RSV_SZ		16
+#define MMU_PT_RSV_LOW		4
+
+struct mmu_pt_rsv {
+	int n;
+	void *va[MMU_PT_RSV_SZ];
+	uintptr_t pa[MMU_PT_RSV_SZ];
+	struct mutex fill_lock;
+	struct thread *filler;
+};
+
+static struct mmu_pt_rsv pt_rsv;
+
 const uintptr_t kmode_va = (uintptr_t)&KMODE_VA;
 
 /* The values correspond to mmu_map_unit. */
@@ -131,6 +155,8 @@ void mmu_init()
 
 	mmu_dcache_clean(pd, 4 * sizeof(uintptr_t));
 	mmu_tlb_invalidate(NULL, 1024 * PAGE_SIZE);
+
+	mutex_init(&pt_rsv.fill_lock);
 }
 
 int mmu_map_sections(const struct mmu_map_req *r)
@@ -221,13 +247,10 @@ int mmu_map_pages(const struct mmu_map_req *r)
 		 * the page/large-page.
 		 */
 		if (k == 0) {
-			lock_sched_unlock(&k_pd_lock);
-			pt = mmu_slub_alloc();
-			tpa = mmu_va_to_pa(pt);
-			lock_sched_lock(&k_pd_lock);
-
-			memset(pt, 0, 1024);
-			mmu_dcache_clean(pt, 1024);
+			assert(pt_rsv.n > 0);
+			--pt_rsv.n;
+			pt = pt_rsv.va[pt_rsv.n];
+			tpa = pt_rsv.pa[pt_rsv.n];
 
 			de  = bits_set(PDE_TYPE0, 1);
 			de |= bits_push(PDE_PT_BASE, tpa);
@@ -289,9 +312,72 @@ int mmu_map_pages(const struct mmu_map_req *r)
 	return 0;
 }
 
+/* Called with k_pd_lock held. The number of PTs a page map needs. */
+static int mmu_pt_need(const struct mmu_map_req *r)
+{
+	int i, s, e, need;
+	const uintptr_t *pd;
+	uintptr_t va;
+
+	pd = (uintptr_t *)&k_pd_start;
+	va = (uintptr_t)r->va_start;
+	s = bits_get(va, VA_PDE_IX);
+	va += (r->n << (map_units[r->mu] + PAGE_SIZE_SZ)) - 1;
+	e = bits_get(va, VA_PDE_IX);
+
+	need = 0;
+	for (i = s; i <= e; ++i)
+		if (bits_get(pd[i], PDE_TYPE0) == 0)
+			++need;
+	return need;
+}
+
+/* Adds PTs until the reserve holds n. Each PT goes in as soon as it is
+ * allocated, since the allocation may itself map a page.
+ */
+_ctx_proc
+static void mmu_pt_rsv_fill(int n)
+{
+	void *pt;
+	uintptr_t pa;
+
+	assert(n <= MMU_PT_RSV_SZ);
+	mutex_lock(&pt_rsv.fill_lock);
+	pt_rsv.filler = current;
+	while (1) {
+		lock_sched_lock(&k_pd_lock);
+		if (pt_rsv.n >= n) {
+			lock_sched_unlock(&k_pd_lock);
+			break;
+		}
+		lock_sched_unlock(&k_pd_lock);
+
+		pt = mmu_slub_alloc();
+		pa = mmu_va_to_pa(pt);
+		memset(pt, 0, 1024);
+		mmu_dcache_clean(pt, 1024);
+
+		lock_sched_lock(&k_pd_lock);
+		if (pt_rsv.n < MMU_PT_RSV_SZ) {
+			pt_rsv.va[pt_rsv.n] = pt;
+			pt_rsv.pa[pt_rsv.n] = pa;
+			++pt_rsv.n;
+			pt = NULL;
+		}
+		lock_sched_unlock(&k_pd_lock);
+
+		if (pt) {
+			mmu_slub_free(pt);
+			break;
+		}
+	}
+	pt_rsv.filler = NULL;
+	mutex_unlock(&pt_rsv.fill_lock);
+}
+
 int mmu_map(const struct mmu_map_req *r)
 {
-	int ret;
+	int ret, need;
 	uintptr_t mask, va, pa, inc;
 
 	assert(r && r->n > 0);
@@ -301,6 +387,20 @@ int mmu_map(const struct mmu_map_req *r)
 
 	lock_sched_lock(&k_pd_lock);
 
+	/* The lock is dropped only before the map starts. */
+	if (r->mu == MAP_UNIT_PAGE || r->mu == MAP_UNIT_LARGE_PAGE) {
+		need = mmu_pt_need(r);
+		if (pt_rsv.filler == current)
+			assert(need <= pt_rsv.n);
+		while (pt_rsv.filler != current && need &&
+		       need + MMU_PT_RSV_LOW > pt_rsv.n) {
+			lock_sched_unlock(&k_pd_lock);
+			mmu_pt_rsv_fill(need + MMU_PT_RSV_LOW);
+			lock_sched_lock(&k_pd_lock);
+			need = mmu_pt_need(r);
+		}
+	}
+
 	/* The addresses must be aligned corresponding to the unit
 	 * requested.
 	 */
@@ -313,6 +413,10 @@ int mmu_map(const struct mmu_map_req *r)
 	assert((va & mask) == 0);
 	assert((pa & mask) == 0);
 
+	/* A cacheable mapping must not change the colour of the pages. */
+	if (r->mt == MT_NRM_IO_WTNA || r->mt == MT_NRM_IO_WBNA ||
+	    r->mt == MT_NRM_IO_WBA)
+		assert(bits_get(va, CACHE_COLOUR) == bits_get(pa, CACHE_COLOUR));
 
 	if (r->mu == MAP_UNIT_SECTION || r->mu == MAP_UNIT_SUPER_SECTION)
 		ret = mmu_map_sections(r);
@@ -327,7 +431,7 @@ int mmu_unmap(const struct mmu_map_req *r)
 {
 	int i, j, k, n;
 	const int nunits[4] = {1, 16, 1, 16};
-	uintptr_t mask, va, pa, inc, *pd, *pt;
+	uintptr_t mask, va, pa, inc, tpa, *pd, *pt;
 
 	assert(r && r->n > 0);
 	assert(r->mu < MAP_UNIT_MAX);
@@ -381,8 +485,8 @@ int mmu_unmap(const struct mmu_map_req *r)
 				pt = (uintptr_t*)&k_pt_start;
 				pt += (j - 0x400) * 0x100;
 			} else {
-				pa = bits_pull(pd[j], PDE_PT_BASE);
-				pt = mmu_slub_pa_to_va(pa);
+				tpa = bits_pull(pd[j], PDE_PT_BASE);
+				pt = mmu_slub_pa_to_va(tpa);
 			}
 
 			pt = &pt[bits_get(va, VA_PTE_IX)];
@@ -16,29 +16,161 @@
  */
 
 #include <assert.h>
+#include <atomic.h>
 #include <bdy.h>
+#include <io.h>
 #include <mmu.h>
 #include <pm.h>
 #include <string.h>
 #include <mutex.h>
+#include <lock.h>
+#include <sched.h>
+#include <uart.h>
 
 #include <sys/mmu.h>
 
+/* The buddy engine for the RAM is picked at build time. */
+#ifdef PM_BDY_FLIST
+#define PM_BDY_TYPE		BDY_TYPE_FLIST
+#else
+#define PM_BDY_TYPE		BDY_TYPE_BITMAP
+#endif
+
 static struct bdy bdy_ram;
 static struct page *ram_map;
 static struct mutex ram_map_lock;
 static size_t ramsz;
 
-static int	_pm_ram_alloc(enum pm_alloc_units unit, int n, uintptr_t *pa);
+/* The mover of each movable block, indexed by the pfn of its leader, or
+ * PM_CMA_PINNED for a contiguous allocation. NULL for the rest.
+ */
+static struct pm_mover **ram_owner;
+
+/* Pages zeroed by the idle thread, kept by colour. The pages are busy in
+ * the buddy.
+ */
+#define PM_ZPOOL_SZ		32	/* Per colour. */
+static uintptr_t zpool[CACHE_NCOLOURS][PM_ZPOOL_SZ];
+static int zpool_n[CACHE_NCOLOURS];
+static struct lock zpool_lock;
+
+/* The pm_zero_area and pm_copy_area windows are shared by the idle thread,
+ * the synchronous zeroing of the allocations, and the page migrations.
+ * Each window has a page per colour, so that a page is only ever mapped at
+ * a VA of its own colour.
+ */
+static struct lock window_lock;
+
+/* The contiguous memory area. A section-aligned region at the top of the
+ * RAM, with a buddy of its own. Movable pages are allocated from it, and
+ * are migrated out when a contiguous allocation needs their sections.
+ * owner is the area's slice of ram_owner.
+ */
+#define PM_CMA_SZ		(16 * 1024 * 1024)
+#define PM_CMA_PINNED		((struct pm_mover *)1)
+
+struct pm_cma {
+	uintptr_t pfn;
+	int npfns;
+	struct bdy bdy;
+	struct pm_mover **owner;
+};
+static struct pm_cma cma;
+
+/* Compaction. When too much of the free memory is in blocks smaller than
+ * a unit, the compaction thread rebuilds blocks of the unit by moving the
+ * movable blocks out of an aligned region. It starts at PM_COMPACT_HIGH
+ * and stops at PM_COMPACT_LOW, as fragmentation indices.
+ */
+#define PM_COMPACT_HIGH		500
+#define PM_COMPACT_LOW		250
+
+static const enum pm_alloc_units compact_units[] = {
+	PM_UNIT_SECTION,
+	PM_UNIT_LARGE_PAGE,
+};
+static struct list_head compact_wq;
+static int compact_cond;
+
+/* Only the movable blocks outside of the contiguous area can be compacted.
+ * compact_gen counts their allocations and frees. A pass which fails is
+ * not tried again until compact_gen moves on from compact_fail_gen.
+ * Guarded by ram_map_lock.
+ */
+static int compact_nmovable;
+static uint32_t compact_gen;
+static uint32_t compact_fail_gen;
+
+/* Shrinking. When less than 1/PM_SHRINK_DIV of the RAM is free, the
+ * compaction thread first asks the shrinkers to give back the free memory
+ * they hold.
+ */
+#define PM_SHRINK_DIV		32
+
+static struct list_head shrinkers;
+
+/* Always-on counters, under ram_map_lock. The blocks handed out and given
+ * back, by unit, and the pm_ram_alloc() calls which failed.
+ */
+static uint32_t pm_nalloc[PM_UNIT_MAX];
+static uint32_t pm_nfreed[PM_UNIT_MAX];
+static uint32_t pm_nfail;
+
+static int	_pm_ram_alloc(enum pm_alloc_units unit, int flags, int n,
+			      uintptr_t *pa);
+
+/* Mark npages units starting at pos busy, or free, in the buddy b, as the
+ * largest naturally aligned blocks which fit.
+ */
+static void pm_bdy_range(struct bdy *b, int pos, int npages, char busy)
+{
+	int unit, ret;
+
+	while (npages) {
+		unit = 31 - bits_clz(npages);
+		if (pos && bits_ctz(pos) < unit)
+			unit = bits_ctz(pos);
+		if (unit > PM_UNIT_MAX - 1)
+			unit = PM_UNIT_MAX - 1;
+
+		if (busy) {
+			ret = bdy_reserve(b, unit, pos >> unit);
+		} else {
+			pos >>= unit;
+			ret = bdy_free(b, unit, 1, &pos);
+			pos <<= unit;
+		}
+		assert(ret == 0);
+
+		pos += 1 << unit;
+		npages -= 1 << unit;
+	}
+}
+
+static int pm_colour(uintptr_t pa)
+{
+	return bits_get(pa, CACHE_COLOUR);
+}
+
+/* The window page of pa's colour. */
+static void *pm_window(char *area, uintptr_t pa)
+{
+	return area + ((uintptr_t)pm_colour(pa) << PAGE_SIZE_SZ);
+}
+
+static char pm_cma_has(uintptr_t pfn)
+{
+	return pfn >= cma.pfn && pfn < cma.pfn + cma.npfns;
+}
 
 void pm_init(uint32_t ram, uint32_t _ramsz)
 {
-	int i, mapsz, npfns, ret;
-	size_t _128mb;
-	uintptr_t pa[4], va, t;
+	int i, ret, npfns;
+	size_t mapsz, bdysz, ownsz, cmasz, metasz, metamapsz, rsvdsz;
+	void *map;
+	uintptr_t va, t;
 	struct mmu_map_req r;
-	extern char bdy_map_start;
-	extern char ram_map_start;
+	extern char ram_map_start, ram_map_end;
 	extern char text_start, text_end;
 	extern char rodata_start, rodata_end;
 	extern char data_start, data_end;
@@ -57,48 +189,51 @@ void pm_init(uint32_t ram, uint32_t _ramsz)
 	};
 
 	mutex_init(&ram_map_lock);
+	init_list_head(&compact_wq);
+	init_list_head(&shrinkers);
 	ramsz = _ramsz;
 
-
 	/* For RPi, the RAM start is expected to be at physical zero. */
 	assert(ram == 0);
 	assert(ramsz);
 
-	/* Restrict RAM usage to 128MB. */
-	_128mb = 128 * 1024 * 1024;
-	if (ramsz > _128mb)
-		ramsz = _128mb;
-
-	/* The map must be a maximum of 2 pages long. */
+	/* The first 8MB of RAM are reserved for the kernel. */
+	rsvdsz = 8 * 1024 * 1024;
 	npfns = ramsz >> PAGE_SIZE_SZ;
-	mapsz = ALIGN_UP(bdy_map_size(npfns), PAGE_SIZE);
-	mapsz >>= PAGE_SIZE_SZ;
-	assert(mapsz > 0 && mapsz < 3);
-	bdy_init(&bdy_ram, (void *)&bdy_map_start, npfns);
-
-	/* Reserve the first 8MB of RAM. */
-	ret = _pm_ram_alloc(PM_UNIT_2MB, 4, pa);
-	assert(ret == 0);
-	for (i = 0; i < 4; ++i)
-		assert(pa[i] == (size_t)i * 2 * 1024 * 1024);
 
-	ram_map = (struct page *)&ram_map_start;
-
-	mapsz = ALIGN_UP(npfns * sizeof(struct page), PAGE_SIZE);
+	/* Only set up the contiguous memory area if it takes up at most a
+	 * quarter of the RAM.
+	 */
+	if (ramsz >= 4 * PM_CMA_SZ) {
+		cma.npfns = PM_CMA_SZ >> PAGE_SIZE_SZ;
+		cma.pfn = ALIGN_DN(ramsz, SECTION_SIZE) >> PAGE_SIZE_SZ;
+		cma.pfn -= cma.npfns;
+	}
 
-	/* 128MB RAM is equivalent to 32768 4KB frames. The current
-	 * sizeof(struct page) is 8 bytes, which results in a
-	 * ram_map of size 256KB. To allow growing the struct page,
-	 * the maximum size the map can consume is fixed at 1MB.
+	/* The RAM metadata, i.e. the ram_map followed by the buddy map, the
+	 * owners, and the buddy map of the contiguous memory area, is sized
+	 * from the RAM reported by the ATAGs. It is carved from the
+	 * RAM right after the reserved 8MB, and is mapped with sections at
+	 * ram_map_start, since neither the buddy nor the slub is ready yet.
+	 *
+	 * The metadata window is 8MB long. With the current 8 byte struct
+	 * page, 1GB of RAM needs a ram_map of 2MB, a buddy bitmap of
+	 * 17 pages, and 1MB of owners.
 	 */
-	assert(mapsz <= 1024 * 1024);
+	mapsz = ALIGN_UP(npfns * sizeof(struct page), PAGE_SIZE);
+	bdysz = ALIGN_UP(bdy_map_size(PM_BDY_TYPE, npfns), PAGE_SIZE);
+	ownsz = ALIGN_UP(npfns * sizeof(ram_owner[0]), PAGE_SIZE);
+	cmasz = ALIGN_UP(bdy_map_size(BDY_TYPE_BITMAP, cma.npfns), PAGE_SIZE);
+	metasz = mapsz + bdysz + ownsz + cmasz;
+	metamapsz = ALIGN_UP(metasz, SECTION_SIZE);
+	assert(metamapsz <= (size_t)(&ram_map_end - &ram_map_start));
+	assert(rsvdsz + metamapsz <= ramsz);
 
-	ret = _pm_ram_alloc(PM_UNIT_SECTION, 1, pa);
-	assert(ret == 0);
+	ram_map = (struct page *)&ram_map_start;
 
 	r.va_start = ram_map;
-	r.pa_start = pa[0];
-	r.n = 1;
+	r.pa_start = rsvdsz;
+	r.n = metamapsz >> SECTION_SIZE_SZ;
 	r.mt = MT_NRM_IO_WBA;
 	r.ap = AP_SRW;
 	r.mu = MAP_UNIT_SECTION;
@@ -110,13 +245,51 @@ void pm_init(uint32_t ram, uint32_t _ramsz)
 
 	memset(ram_map, 0, mapsz);
 
+	/* The BDY_TYPE_FLIST engine threads its free lists through the
+	 * ram_map, and needs no separate map.
+	 */
+	if (PM_BDY_TYPE == BDY_TYPE_FLIST)
+		map = ram_map;
+	else
+		map = (char *)ram_map + mapsz;
+	bdy_init(&bdy_ram, PM_BDY_TYPE, map, npfns);
+
+	ram_owner = (void *)((char *)ram_map + mapsz + bdysz);
+	memset(ram_owner, 0, npfns * sizeof(ram_owner[0]));
+
+	/* Reserve the first 8MB of RAM, and the metadata up to the end of
+	 * its last section. The rest of that section stays mapped cacheable,
+	 * and, were it handed out, could be mapped again with other
+	 * attributes, which the architecture forbids.
+	 */
+	pm_bdy_range(&bdy_ram, 0, rsvdsz >> PAGE_SIZE_SZ, 1);
+	pm_bdy_range(&bdy_ram, rsvdsz >> PAGE_SIZE_SZ,
+		     metamapsz >> PAGE_SIZE_SZ, 1);
+
+	/* The area is busy in bdy_ram, and managed by its own buddy. It
+	 * always uses the bitmap engine, since the free-list engine of
+	 * bdy_ram owns the struct page of the free blocks.
+	 */
+	if (cma.npfns) {
+		pm_bdy_range(&bdy_ram, cma.pfn, cma.npfns, 1);
+
+		map = (char *)ram_map + mapsz + bdysz + ownsz;
+		bdy_init(&cma.bdy, BDY_TYPE_BITMAP, map, cma.npfns);
+		cma.owner = &ram_owner[cma.pfn];
+	}
+
+	t = rsvdsz >> PAGE_SIZE_SZ;
+	for (i = 0; (unsigned)i < metamapsz >> PAGE_SIZE_SZ; ++i) {
+		ram_map[t + i].flags |= bits_set(PGF_UNIT, PM_UNIT_PAGE);
+		ram_map[t + i].flags |= bits_on(PGF_HEAD);
+		ram_map[t + i].u0.ref = 1;
+	}
+
 	/* The pages used to map the sections (one of which includes the
 	 * pages for k_pd, k_pt, k_pta_pt and ram_map_pt) must be filled
 	 * into the array. The physical addresses for these statically
 	 * allocated sections are easy to calculate without parsing the page
 	 * tables.
-	 *
-	 * Moreover, the data pages of the ram_map must be filled in.
 	 */
 
 	for (i = 0; (unsigned)i < ARRAY_SIZE(si); ++i) {
@@ -124,81 +297,428 @@ void pm_init(uint32_t ram, uint32_t _ramsz)
 			t = va - kmode_va;
 			t >>= PAGE_SIZE_SZ;
 			ram_map[t].flags |= bits_set(PGF_UNIT, PM_UNIT_PAGE);
+			ram_map[t].flags |= bits_on(PGF_HEAD);
 			ram_map[t].u0.ref = 1;
 		}
 	}
 
-	/* There are 256 4KB contigous pages in a 1MB allocation. */
-	t = pa[0] >> PAGE_SIZE_SZ;
-	for (i = 0; i < 256; ++i) {
-		ram_map[t + i].flags |= bits_set(PGF_UNIT, PM_UNIT_SECTION);
-		ram_map[t + i].u0.ref = 1;
-	}
-
 	/* After this point, the pm_ram_alloc and pm_ram_free routines
 	 * can be used.
 	 */
 }
 
-static int _pm_ram_alloc(enum pm_alloc_units unit, int n, uintptr_t *pa)
+/* Called with window_lock held. */
+static void pm_window_map(void *va, uintptr_t pa, char map)
 {
-	int i, ret, pos;
+	int ret;
+	struct mmu_map_req r;
+
+	r.va_start = va;
+	r.pa_start = pa;
+	r.n = 1;
+	r.mt = MT_NRM_IO_WBA;
+	r.ap = AP_SRW;
+	r.mu = MAP_UNIT_PAGE;
+	r.flags  = bits_on(MMR_XN);
+	r.flags |= bits_on(MMR_AF);
+
+	if (map)
+		ret = mmu_map(&r);
+	else
+		ret = mmu_unmap(&r);
+	assert(ret == 0);
+}
+
+static void pm_ram_zero(uintptr_t pa)
+{
+	void *va;
+	extern char pm_zero_area;
+
+	va = pm_window(&pm_zero_area, pa);
+	lock_sched_lock(&window_lock);
+	pm_window_map(va, pa, 1);
+	memset(va, 0, PAGE_SIZE);
+	pm_window_map(va, pa, 0);
+	lock_sched_unlock(&window_lock);
+}
+
+/* Copy a block, a page at a time. For use by the movers. */
+void pm_ram_copy(uintptr_t dst, uintptr_t src, enum pm_alloc_units unit)
+{
+	int i;
+	void *d, *s;
+	extern char pm_zero_area, pm_copy_area;
+
+	for (i = 0; i < (1 << unit); ++i) {
+		d = pm_window(&pm_zero_area, dst);
+		s = pm_window(&pm_copy_area, src);
+		lock_sched_lock(&window_lock);
+		pm_window_map(d, dst, 1);
+		pm_window_map(s, src, 1);
+		memcpy(d, s, PAGE_SIZE);
+		pm_window_map(s, src, 0);
+		pm_window_map(d, dst, 0);
+		lock_sched_unlock(&window_lock);
+
+		dst += PAGE_SIZE;
+		src += PAGE_SIZE;
+	}
+}
+
+/* Take up to n pages from the pool, of the colour in flags, if any. */
+static int pm_zpool_get(int flags, int n, uintptr_t *pa)
+{
+	int i, c;
+
+	i = 0;
+	lock_sched_lock(&zpool_lock);
+	for (c = 0; c < CACHE_NCOLOURS; ++c) {
+		if (bits_get(flags, PMA_COLOURED) &&
+		    (int)bits_get(flags, PMA_COLOUR) != c)
+			continue;
+		for (; i < n && zpool_n[c]; ++i)
+			pa[i] = zpool[c][--zpool_n[c]];
+	}
+	lock_sched_unlock(&zpool_lock);
+	return i;
+}
+
+/* Whether the pool holds the page at the pfn p. */
+static char pm_zpool_has(uintptr_t p)
+{
+	int i, c;
+	char ret;
+
+	ret = 0;
+	c = pm_colour(p << PAGE_SIZE_SZ);
+	lock_sched_lock(&zpool_lock);
+	for (i = 0; i < zpool_n[c] && !ret; ++i)
+		ret = zpool[c][i] == (p << PAGE_SIZE_SZ);
+	lock_sched_unlock(&zpool_lock);
+	return ret;
+}
+
+static void pm_zpool_put(int n, const uintptr_t *pa)
+{
+	int i, c;
+
+	lock_sched_lock(&zpool_lock);
+	for (i = 0; i < n; ++i) {
+		c = pm_colour(pa[i]);
+		assert(zpool_n[c] < PM_ZPOOL_SZ);
+		zpool[c][zpool_n[c]++] = pa[i];
+	}
+	lock_sched_unlock(&zpool_lock);
+}
+
+/* Called with ram_map_lock held. Returns the pool to the buddy, so that the
+ * pool never causes an allocation to fail.
+ */
+static int pm_zpool_drain()
+{
+	int i, n, pos, ret;
+	uintptr_t pa[CACHE_NCOLOURS * PM_ZPOOL_SZ];
+
+	n = pm_zpool_get(0, ARRAY_SIZE(pa), pa);
+	for (i = 0; i < n; ++i) {
+		pos = pa[i] >> PAGE_SIZE_SZ;
+		ret = bdy_free(&bdy_ram, PM_UNIT_PAGE, 1, &pos);
+		assert(ret == 0);
+	}
+	return n ? 0 : -1;
+}
+
+/* Called by the idle thread, which must not sleep. Zeroes one page, of
+ * the colour the pool is shortest of, into the pool. Returns 0 if a page
+ * was zeroed.
+ */
+_ctx_proc
+int pm_ram_prezero()
+{
+	int c, i, ret;
+	uintptr_t pa;
+
+	c = 0;
+	lock_sched_lock(&zpool_lock);
+	for (i = 1; i < CACHE_NCOLOURS; ++i)
+		if (zpool_n[i] < zpool_n[c])
+			c = i;
+	ret = zpool_n[c] == PM_ZPOOL_SZ;
+	lock_sched_unlock(&zpool_lock);
+	if (ret)
+		return -1;
+
+	if (mutex_trylock(&ram_map_lock))
+		return -1;
+	ret = _pm_ram_alloc(PM_UNIT_PAGE,
+			    bits_on(PMA_COLOURED) | bits_set(PMA_COLOUR, c),
+			    1, &pa);
+	mutex_unlock(&ram_map_lock);
+	if (ret)
+		return -1;
+
+	pm_ram_zero(pa);
+
+	/* Only the idle thread adds to the pool. */
+	pm_zpool_put(1, &pa);
+	return 0;
+}
+
+/* The colour of a page is the low bits of its buddy position.
+ * Called with ram_map_lock held.
+ */
+static int pm_bdy_alloc(struct bdy *b, enum pm_alloc_units unit, int flags,
+			int n, int *pos)
+{
+	if (unit != PM_UNIT_PAGE || !bits_get(flags, PMA_COLOURED))
+		return bdy_alloc(b, unit, n, pos);
+	return bdy_alloc_colour(b, CACHE_NCOLOURS - 1,
+				bits_get(flags, PMA_COLOUR), n, pos);
+}
+
+/* The buddy positions are collected in place in pa. uintptr_t and int are
+ * both 32 bits wide.
+ */
+static int _pm_ram_alloc(enum pm_alloc_units unit, int flags, int n,
+			 uintptr_t *pa)
+{
+	int i, ret;
 	assert(unit < PM_UNIT_MAX);
 
-	ret = -1;
+	ret = pm_bdy_alloc(&bdy_ram, unit, flags, n, (int *)pa);
+	if (ret)
+		return ret;
+
 	for (i = 0; i < n; ++i) {
-		ret = bdy_alloc(&bdy_ram, unit, &pos);
-		if (ret)
+		pa[i] <<= unit;
+		pa[i] <<= PAGE_SIZE_SZ;
+	}
+	return ret;
+}
+
+/* Called with ram_map_lock held. Only the leaders are initialised, so
+ * that the cost does not depend on the unit.
+ */
+static void pm_ram_init_pages(enum pm_alloc_units unit,
+			      enum pm_page_usage use, int n,
+			      const uintptr_t *pa)
+{
+	int i;
+	struct page *pg;
+
+	pm_nalloc[unit] += n;
+	for (i = 0; i < n; ++i) {
+		pg = &ram_map[pa[i] >> PAGE_SIZE_SZ];
+		memset(pg, 0, sizeof(*pg));
+		pg->flags |= bits_set(PGF_UNIT, unit);
+		pg->flags |= bits_set(PGF_USE, use);
+		pg->flags |= bits_on(PGF_HEAD);
+		if (use == PGF_USE_NORMAL)
+			pg->u0.ref = 1;
+	}
+}
+
+/* Called with ram_map_lock held. Whether the free memory is fragmented
+ * beyond the threshold for the unit, while there is enough of it for the
+ * compaction to rebuild a block.
+ */
+static char pm_compact_needed(enum pm_alloc_units unit, int thresh)
+{
+	int i;
+	uint32_t total, usable;
+
+	total = usable = 0;
+	for (i = 0; i < PM_UNIT_MAX; ++i) {
+		total += bdy_ram.nfree[i] << i;
+		if (i >= (int)unit)
+			usable += bdy_ram.nfree[i] << i;
+	}
+
+	if (total < (2u << unit))
+		return 0;
+	return (total - usable) * 1000 >= total * (uint32_t)thresh;
+}
+
+/* Called with ram_map_lock held. Whether a pass of the compaction is worth
+ * trying.
+ */
+static char pm_compact_wanted(enum pm_alloc_units unit, int thresh)
+{
+	if (compact_nmovable == 0 || compact_gen == compact_fail_gen)
+		return 0;
+	return pm_compact_needed(unit, thresh);
+}
+
+/* Called with ram_map_lock held. */
+static char pm_shrink_needed()
+{
+	int i;
+	uint32_t total;
+
+	total = 0;
+	for (i = 0; i < PM_UNIT_MAX; ++i)
+		total += bdy_ram.nfree[i] << i;
+	return total * PM_SHRINK_DIV < (ramsz >> PAGE_SIZE_SZ);
+}
+
+/* Called with ram_map_lock held. */
+static char pm_compact_check()
+{
+	unsigned i;
+
+	if (pm_shrink_needed() && !list_empty(&shrinkers))
+		return 1;
+
+	for (i = 0; i < ARRAY_SIZE(compact_units); ++i)
+		if (pm_compact_wanted(compact_units[i], PM_COMPACT_HIGH))
+			return 1;
+	return 0;
+}
+
+static void pm_compact_wake()
+{
+	compact_cond = 1;
+	wake_up(&compact_wq);
+}
+
+int pm_ram_alloc(enum pm_alloc_units unit, enum pm_page_usage use, int flags,
+		 int n, uintptr_t *pa)
+{
+	int i, j, nz, ret;
+	char wake;
+
+	mutex_lock(&ram_map_lock);
+
+	nz = 0;
+	if (unit == PM_UNIT_PAGE && bits_get(flags, PMA_ZERO))
+		nz = pm_zpool_get(flags, n, pa);
+
+	ret = 0;
+	while (nz < n) {
+		ret = _pm_ram_alloc(unit, flags, n - nz, &pa[nz]);
+		if (ret == 0 || pm_zpool_drain())
 			break;
-		pa[i] = pos;
 	}
 
-	if (ret == 0) {
-		for (i = 0; i < n; ++i) {
-			pa[i] <<= unit;
-			pa[i] <<= PAGE_SIZE_SZ;
-		}
-		return ret;
+	if (ret) {
+		pm_zpool_put(nz, pa);
+		++pm_nfail;
+		goto exit;
 	}
 
-	for (i = i - 1; i >= 0; --i)
-		bdy_free(&bdy_ram, unit, pa[i]);
+	pm_ram_init_pages(unit, use, n, pa);
+exit:
+	wake = pm_compact_check();
+	mutex_unlock(&ram_map_lock);
+
+	if (wake)
+		pm_compact_wake();
+
+	if (ret || !bits_get(flags, PMA_ZERO))
+		return ret;
+
+	/* Zero the pages which did not come from the pool. */
+	for (i = nz; i < n; ++i) {
+		for (j = 0; j < (1 << unit); ++j)
+			pm_ram_zero(pa[i] + ((uintptr_t)j << PAGE_SIZE_SZ));
+	}
 	return ret;
 }
 
-int pm_ram_alloc(enum pm_alloc_units unit, enum pm_page_usage use, int n,
-		 uintptr_t *pa)
+/* Movable allocations come from the contiguous memory area, if it has
+ * room, or else from the rest of the RAM, where only the compaction moves
+ * them. Blocks of up to a section never straddle the sections of a
+ * contiguous allocation.
+ */
+int pm_ram_alloc_movable(enum pm_alloc_units unit, int flags, int n,
+			 uintptr_t *pa, struct pm_mover *mv)
 {
 	int i, j, ret;
 	uintptr_t t;
-	struct page *pg;
 
+	assert(unit <= PM_UNIT_SECTION);
+	assert(mv && mv->move);
+
+	/* The area starts at a section, so the positions in cma.bdy have the
+	 * colours of their pages.
+	 */
+	ret = -1;
 	mutex_lock(&ram_map_lock);
-	ret = _pm_ram_alloc(unit, n, pa);
-	if (ret)
-		goto exit;
+	if (cma.npfns)
+		ret = pm_bdy_alloc(&cma.bdy, unit, flags, n, (int *)pa);
+	if (ret) {
+		mutex_unlock(&ram_map_lock);
+		ret = pm_ram_alloc(unit, PGF_USE_NORMAL, flags, n, pa);
+		if (ret)
+			return ret;
+
+		/* The blocks can still be moved by the compaction. */
+		mutex_lock(&ram_map_lock);
+		for (i = 0; i < n; ++i)
+			ram_owner[pa[i] >> PAGE_SIZE_SZ] = mv;
+		compact_nmovable += n;
+		++compact_gen;
+		mutex_unlock(&ram_map_lock);
+		return ret;
+	}
 
 	for (i = 0; i < n; ++i) {
-		t = pa[i] >> PAGE_SIZE_SZ;
-		for (j = 0; j < (1 << unit); ++j) {
-			pg = &ram_map[t + j];
-			memset(pg, 0, sizeof(*pg));
-			pg->flags |= bits_set(PGF_UNIT, unit);
-			pg->flags |= bits_set(PGF_USE, use);
-			if (use == PGF_USE_NORMAL)
-				ram_map[t + j].u0.ref = 1;
-		}
+		t = pa[i] << unit;
+		cma.owner[t] = mv;
+		pa[i] = (cma.pfn + t) << PAGE_SIZE_SZ;
 	}
-exit:
+	pm_ram_init_pages(unit, PGF_USE_NORMAL, n, pa);
 	mutex_unlock(&ram_map_lock);
+
+	if (!bits_get(flags, PMA_ZERO))
+		return ret;
+
+	for (i = 0; i < n; ++i) {
+		for (j = 0; j < (1 << unit); ++j)
+			pm_ram_zero(pa[i] + ((uintptr_t)j << PAGE_SIZE_SZ));
+	}
 	return ret;
 }
 
 
+/* Called with ram_map_lock held. p is the pfn of the leader. */
+static void pm_ram_free_block(enum pm_alloc_units unit, uintptr_t p)
+{
+	int pos, ret;
+
+	++pm_nfreed[unit];
+
+	/* The block stops being found by pm_ram_get_page(). The free-list
+	 * engine reuses the leader's fields.
+	 */
+	ram_map[p].flags = 0;
+	ram_map[p].u0.ref = 0;
+
+	assert(ram_owner[p] != PM_CMA_PINNED);
+	if (ram_owner[p] && !pm_cma_has(p)) {
+		--compact_nmovable;
+		++compact_gen;
+	}
+	ram_owner[p] = NULL;
+
+	/* The page must be busy in the buddy. Freeing does not search, so
+	 * there is no scan to share between the blocks.
+	 */
+	if (pm_cma_has(p)) {
+		p -= cma.pfn;
+		pos = p >> unit;
+		ret = bdy_free(&cma.bdy, unit, 1, &pos);
+	} else {
+		pos = p >> unit;
+		ret = bdy_free(&bdy_ram, unit, 1, &pos);
+	}
+	assert(ret == 0);
+}
+
 int pm_ram_free(enum pm_alloc_units unit, enum pm_page_usage use, int n,
 		const uintptr_t *pa)
 {
-	int i, j, ret;
+	int i, ret;
 	uintptr_t p, mask;
 	struct page *pg;
 
@@ -206,10 +726,9 @@ int pm_ram_free(enum pm_alloc_units unit, enum pm_page_usage use, int n,
 
 	mutex_lock(&ram_map_lock);
 	mask = (1 << unit) - 1;
+
+	/* Validate the whole batch before changing any state. */
 	for (i = 0; i < n; ++i) {
-		/*
-		ret = -1;
-		*/
 		p = pa[i] >> PAGE_SIZE_SZ;
 
 		/* The input addresses must be aligned according to
@@ -217,39 +736,533 @@ int pm_ram_free(enum pm_alloc_units unit, enum pm_page_usage use, int n,
 		 */
 		assert((p & mask) == 0);
 
-		/* The struct page flags must reflect the unit, the use,
+		/* The leader's flags must reflect the unit, the use,
 		 * and an appropriate ref count.
 		 */
-		for (j = 0; j < (1 << unit); ++j) {
-			pg = &ram_map[p + j];
-			assert(bits_get(pg->flags, PGF_UNIT) == unit);
-			assert(bits_get(pg->flags, PGF_USE) == use);
-			if (use == PGF_USE_NORMAL)
-				assert(ram_map[p + j].u0.ref == 1);
-		}
-
-		/* The page must be busy in the buddy bitmap. */
-		ret = bdy_free(&bdy_ram, unit, p >> unit);
-		assert(ret == 0);
-
-		for (j = 0; j < (1 << unit); ++j)
-			ram_map[p + j].u0.ref = 0;
+		pg = &ram_map[p];
+		assert(bits_get(pg->flags, PGF_HEAD));
+		assert(bits_get(pg->flags, PGF_UNIT) == unit);
+		assert(bits_get(pg->flags, PGF_USE) == use);
+		if (use == PGF_USE_NORMAL)
+			assert(pg->u0.ref == 1);
 	}
 
+	for (i = 0; i < n; ++i)
+		pm_ram_free_block(unit, pa[i] >> PAGE_SIZE_SZ);
+
 	mutex_unlock(&ram_map_lock);
 	ret = 0;
 	return ret;
 }
 
-/* TODO: Reference counting. */
+/* Whether the page at pfn l leads an allocated block covering pfn. */
+static char pm_page_covers(uintptr_t l, uintptr_t pfn)
+{
+	const struct page *pg;
+
+	if (l > pfn)
+		return 0;
+	pg = &ram_map[l];
+	return bits_get(pg->flags, PGF_HEAD) &&
+		pfn - l < (1u << bits_get(pg->flags, PGF_UNIT));
+}
+
+/* Lock-free. The ram_map does not move after pm_init. Returns the leader
+ * of the allocated block holding pa, or NULL. The blocks do not overlap,
+ * so the only leader covering a tail is its own, and a stale cache entry
+ * is simply missed. The cache is filled only under ram_map_lock, with the
+ * block seen to cover the tail again: a block freed in between may have
+ * handed the tail's fields to the free-list engine.
+ */
 struct page *pm_ram_get_page(uintptr_t pa)
 {
+	int u;
+	uintptr_t pfn, l;
 	struct page *pg;
 
 	assert(pa < ramsz);
-	pa >>= PAGE_SIZE_SZ;
+	pfn = pa >> PAGE_SIZE_SZ;
+	pg = &ram_map[pfn];
+	if (bits_get(pg->flags, PGF_HEAD))
+		return pg;
+
+	if (bits_get(pg->flags, PGF_TAIL) && pm_page_covers(pg->u0.lead, pfn))
+		return &ram_map[pg->u0.lead];
+
+	for (u = 1; u < PM_UNIT_MAX; ++u) {
+		l = ALIGN_DN(pfn, 1 << u);
+		if (!pm_page_covers(l, pfn))
+			continue;
+
+		if (mutex_trylock(&ram_map_lock))
+			return &ram_map[l];
+		if (pm_page_covers(l, pfn)) {
+			pg->flags = bits_on(PGF_TAIL);
+			pg->u0.lead = l;
+		}
+		mutex_unlock(&ram_map_lock);
+		return &ram_map[l];
+	}
+	return NULL;
+}
+
+/* The reference count of a block is held by its leader page. Taking a
+ * reference is only allowed while holding one.
+ */
+void pm_page_get(struct page *pg)
+{
+	int ret;
+
+	assert(bits_get(pg->flags, PGF_USE) == PGF_USE_NORMAL);
+	ret = atomic_inc_return(&pg->u0.ref);
+	assert(ret > 1);
+}
+
+/* Dropping the last reference frees the block. Only that case takes the
+ * ram_map_lock.
+ */
+_ctx_proc
+int pm_page_put(struct page *pg)
+{
+	int unit, ret;
+	uintptr_t p;
+
+	assert(bits_get(pg->flags, PGF_USE) == PGF_USE_NORMAL);
+	ret = atomic_dec_return(&pg->u0.ref);
+	assert(ret >= 0);
+	if (ret)
+		return ret;
+
+	p = pg - ram_map;
+	unit = bits_get(pg->flags, PGF_UNIT);
+	assert((p & ((1 << unit) - 1)) == 0);
+
+	mutex_lock(&ram_map_lock);
+	pm_ram_free_block(unit, p);
+	mutex_unlock(&ram_map_lock);
+	return ret;
+}
+
+/* Called with ram_map_lock held. Moves the movable block led by the pfn
+ * src to a new block in bdy_ram. The block at src is left busy in its
+ * buddy, without users or an owner, for the caller to dispose of.
+ */
+static int pm_ram_move(uintptr_t src)
+{
+	int i, unit, flags, ret;
+	uintptr_t dst;
+	struct pm_mover *mv;
+
+	mv = ram_owner[src];
+	assert(mv && mv != PM_CMA_PINNED);
+	unit = bits_get(ram_map[src].flags, PGF_UNIT);
+
+	/* The users keep their VAs, so the block must keep its colour. */
+	flags  = bits_on(PMA_COLOURED);
+	flags |= bits_set(PMA_COLOUR, pm_colour(src << PAGE_SIZE_SZ));
+	ret = _pm_ram_alloc(unit, flags, 1, &dst);
+	if (ret && pm_zpool_drain() == 0)
+		ret = _pm_ram_alloc(unit, flags, 1, &dst);
+	if (ret)
+		return ret;
+
+	src <<= PAGE_SIZE_SZ;
+	ret = mv->move(mv, unit, src, dst);
+	if (ret) {
+		i = dst >> (PAGE_SIZE_SZ + unit);
+		bdy_free(&bdy_ram, unit, 1, &i);
+		return ret;
+	}
+
+	/* The leader, including the reference count, moves along. */
+	src >>= PAGE_SIZE_SZ;
+	dst >>= PAGE_SIZE_SZ;
+	ram_map[dst] = ram_map[src];
+	ram_map[src].flags = 0;
+	ram_map[src].u0.ref = 0;
+	ram_owner[dst] = mv;
+	ram_owner[src] = NULL;
+	return 0;
+}
+
+/* Called with ram_map_lock held. Moves the movable block led by the
+ * area's page i out to the rest of the RAM.
+ */
+static int pm_cma_evacuate(int i)
+{
+	int unit, ret;
+	uintptr_t src;
+
+	src = cma.pfn + i;
+	unit = bits_get(ram_map[src].flags, PGF_UNIT);
+	ret = pm_ram_move(src);
+	if (ret)
+		return ret;
+
+	i >>= unit;
+	ret = bdy_free(&cma.bdy, unit, 1, &i);
+	assert(ret == 0);
+	return 0;
+}
+
+/* Allocate n physically contiguous sections from the contiguous memory
+ * area. The movable blocks in the way are migrated out. The memory is
+ * mapped uncached at the area's window, and *bus receives its VideoCore
+ * bus address, so that a DMA can cover it with a single descriptor.
+ */
+_ctx_proc
+int pm_cma_alloc(int n, void **va, uintptr_t *bus)
+{
+	int i, s, e, spp, ret;
+	struct mmu_map_req r;
+	extern char pm_cma_area;
+
+	spp = 1 << (SECTION_SIZE_SZ - PAGE_SIZE_SZ);
+	if (n <= 0 || n * spp > cma.npfns)
+		return -1;
+
+	mutex_lock(&ram_map_lock);
+
+	/* Find the first run of n sections without a pinned page. */
+	e = n * spp;
+	for (s = 0; s + e <= cma.npfns; s += spp) {
+		for (i = s; i < s + e; ++i)
+			if (cma.owner[i] == PM_CMA_PINNED)
+				break;
+		if (i == s + e)
+			break;
+	}
+
+	ret = -1;
+	if (s + e > cma.npfns)
+		goto exit;
+
+	for (i = s; i < s + e; ++i) {
+		if (cma.owner[i] == NULL)
+			continue;
+		ret = pm_cma_evacuate(i);
+		if (ret)
+			goto exit;
+	}
+
+	pm_bdy_range(&cma.bdy, s, e, 1);
+	for (i = s; i < s + e; ++i)
+		cma.owner[i] = PM_CMA_PINNED;
+	ret = 0;
+exit:
+	mutex_unlock(&ram_map_lock);
+	if (ret)
+		return ret;
+
+	/* The movable blocks were mapped cacheable. Any of their lines
+	 * still in the cache must be gone before the uncached mapping
+	 * goes up.
+	 */
+	r.va_start = &pm_cma_area + (s << PAGE_SIZE_SZ);
+	r.pa_start = (cma.pfn + s) << PAGE_SIZE_SZ;
+	r.n = n;
+	r.mt = MT_NRM_IO_WBA;
+	r.ap = AP_SRW;
+	r.mu = MAP_UNIT_SECTION;
+	r.flags  = bits_on(MMR_XN);
+	r.flags |= bits_on(MMR_AF);
+
+	ret = mmu_map(&r);
+	assert(ret == 0);
+	mmu_dcache_clean_inv(r.va_start, n << SECTION_SIZE_SZ);
+	ret = mmu_unmap(&r);
+	assert(ret == 0);
+
+	r.mt = MT_NRM_IO_NC;
+	ret = mmu_map(&r);
+	assert(ret == 0);
+
+	*va = r.va_start;
+	*bus = io_bus_addr(r.pa_start);
+	return 0;
+}
+
+_ctx_proc
+int pm_cma_free(int n, void *va)
+{
+	int i, s, e, ret;
+	struct mmu_map_req r;
+	extern char pm_cma_area;
+
+	s = ((char *)va - &pm_cma_area) >> PAGE_SIZE_SZ;
+	e = n << (SECTION_SIZE_SZ - PAGE_SIZE_SZ);
+	assert(ALIGNED(s, 1 << (SECTION_SIZE_SZ - PAGE_SIZE_SZ)));
+	assert(s >= 0 && s + e <= cma.npfns);
+
+	r.va_start = va;
+	r.pa_start = (cma.pfn + s) << PAGE_SIZE_SZ;
+	r.n = n;
+	r.mu = MAP_UNIT_SECTION;
+	ret = mmu_unmap(&r);
+	assert(ret == 0);
+
+	mutex_lock(&ram_map_lock);
+	for (i = s; i < s + e; ++i) {
+		assert(cma.owner[i] == PM_CMA_PINNED);
+		cma.owner[i] = NULL;
+	}
+	pm_bdy_range(&cma.bdy, s, e, 0);
+	mutex_unlock(&ram_map_lock);
+	return 0;
+}
+
+/* Called with ram_map_lock held. Returns the number of free pages in the
+ * region of the unit at the pfn s, or -1 if a block within the region
+ * cannot move. The pages of the pool count as free, as they are drained
+ * before the move.
+ */
+static int pm_compact_scan(uintptr_t s, enum pm_alloc_units unit)
+{
+	int nf, u;
+	uintptr_t p;
+	struct pm_mover *mv;
+
+	nf = 0;
+	for (p = s; p < s + (1 << unit); p += 1 << u) {
+		u = 0;
+		if (bdy_is_free(&bdy_ram, p) || pm_zpool_has(p)) {
+			++nf;
+			continue;
+		}
+
+		/* p must lead a movable block. */
+		u = bits_get(ram_map[p].flags, PGF_UNIT);
+		mv = ram_owner[p];
+		if (mv == NULL || mv == PM_CMA_PINNED || u >= (int)unit)
+			return -1;
+		assert(ALIGNED(p, 1 << u));
+	}
+	return nf;
+}
+
+/* Called with ram_map_lock held. The free pages of the region are taken
+ * first, so that the moved blocks land outside of it. Once every page is
+ * busy, the region is freed as a single block.
+ */
+static int pm_compact_region(uintptr_t s, enum pm_alloc_units unit)
+{
+	int i, u, pos, ret;
+	uintptr_t p;
+	uint32_t held[(1 << PM_UNIT_SECTION) >> 5];
+
+	assert(unit <= PM_UNIT_SECTION);
+	memset(held, 0, sizeof(held));
+
+	for (i = 0; i < (1 << unit); ++i)
+		if (bdy_reserve(&bdy_ram, 0, s + i) == 0)
+			held[i >> 5] |= 1u << (i & 0x1f);
+
+	ret = 0;
+	for (i = 0; i < (1 << unit); i += 1 << u) {
+		u = 0;
+		if (held[i >> 5] & (1u << (i & 0x1f)))
+			continue;
+
+		p = s + i;
+		u = bits_get(ram_map[p].flags, PGF_UNIT);
+		ret = pm_ram_move(p);
+		if (ret)
+			break;
+		for (pos = i; pos < i + (1 << u); ++pos)
+			held[pos >> 5] |= 1u << (pos & 0x1f);
+	}
+
+	if (ret == 0) {
+		pos = s >> unit;
+		ret = bdy_free(&bdy_ram, unit, 1, &pos);
+		assert(ret == 0);
+		return 0;
+	}
+
+	/* Return what was taken, a page at a time. */
+	for (i = 0; i < (1 << unit); ++i) {
+		if ((held[i >> 5] & (1u << (i & 0x1f))) == 0)
+			continue;
+		pos = s + i;
+		bdy_free(&bdy_ram, 0, 1, &pos);
+	}
+	return ret;
+}
+
+/* Called with ram_map_lock held. */
+static int pm_compact_nblocks(enum pm_alloc_units unit)
+{
+	int i, n;
+
+	n = 0;
+	for (i = unit; i < PM_UNIT_MAX; ++i)
+		n += bdy_ram.nfree[i] << (i - unit);
+	return n;
+}
+
+/* Compact the highest region of the unit which has free pages and can be
+ * emptied. The buddy hands the lowest pages out first, so the blocks move
+ * down, and the regions rebuilt earlier stay free. The scan takes the lock
+ * a region at a time, so the pick is rescanned before the move. Fails
+ * unless the number of free blocks of the unit grows.
+ */
+_ctx_proc
+static int pm_compact(enum pm_alloc_units unit)
+{
+	int nf, nb, ret;
+	uintptr_t s;
+
+	s = ALIGN_DN(ramsz >> PAGE_SIZE_SZ, 1 << unit);
+	while (s) {
+		s -= 1 << unit;
+		if (pm_cma_has(s))
+			continue;
+		mutex_lock(&ram_map_lock);
+		nf = pm_compact_scan(s, unit);
+		mutex_unlock(&ram_map_lock);
+		if (nf > 0 && nf < (1 << unit))
+			break;
+	}
+
+	if (s == 0)
+		return -1;
+
+	/* The pool's pages are scattered, and busy without an owner. It is
+	 * given back only once there is a region to rebuild.
+	 */
+	ret = -1;
 	mutex_lock(&ram_map_lock);
-	pg = &ram_map[pa];
+	pm_zpool_drain();
+	nb = pm_compact_nblocks(unit);
+	if (pm_compact_scan(s, unit) > 0)
+		ret = pm_compact_region(s, unit);
+	if (ret == 0 && pm_compact_nblocks(unit) <= nb)
+		ret = -1;
 	mutex_unlock(&ram_map_lock);
-	return pg;
+	return ret;
+}
+
+/* The shrinkers run without any pm lock held. The list only grows, at
+ * init.
+ */
+_ctx_proc
+static void pm_shrink()
+{
+	struct list_head *e;
+	struct pm_shrinker *s;
+
+	list_for_each(e, &shrinkers) {
+		s = list_entry(e, struct pm_shrinker, entry);
+		s->shrink(s);
+	}
+}
+
+_ctx_init
+void pm_shrinker_register(struct pm_shrinker *s)
+{
+	assert(s && s->shrink);
+	list_add_tail(&s->entry, &shrinkers);
+}
+
+_ctx_proc
+static int pm_compact_thread(void *p)
+{
+	unsigned i;
+	char more;
+	enum pm_alloc_units unit;
+
+	(void)p;
+	while (1) {
+		wait_event(&compact_wq, compact_cond == 1);
+		compact_cond = 0;
+
+		mutex_lock(&ram_map_lock);
+		more = pm_shrink_needed();
+		mutex_unlock(&ram_map_lock);
+		if (more)
+			pm_shrink();
+
+		for (i = 0; i < ARRAY_SIZE(compact_units); ++i) {
+			unit = compact_units[i];
+			do {
+				mutex_lock(&ram_map_lock);
+				more = pm_compact_wanted(unit, PM_COMPACT_LOW);
+				mutex_unlock(&ram_map_lock);
+			} while (more && pm_compact(unit) == 0);
+
+			/* Back off until the movable blocks change. */
+			if (more) {
+				mutex_lock(&ram_map_lock);
+				compact_fail_gen = compact_gen;
+				mutex_unlock(&ram_map_lock);
+			}
+		}
+	}
+	return 0;
+}
+
+_ctx_proc
+void pm_compact_init()
+{
+	struct thread *t;
+
+	t = sched_thread_create(pm_compact_thread, NULL);
+	assert(t);
+}
+
+/* The fragmentation index of a unit is the share, in 1/1000ths, of the
+ * free memory which is in blocks smaller than the unit.
+ */
+_ctx_proc
+void pm_ram_stats(struct pm_ram_stats *st)
+{
+	int i;
+	uint32_t total, usable;
+
+	mutex_lock(&ram_map_lock);
+	total = 0;
+	for (i = 0; i < PM_UNIT_MAX; ++i) {
+		st->nfree[i] = bdy_ram.nfree[i];
+		st->nalloc[i] = pm_nalloc[i];
+		st->nfreed[i] = pm_nfreed[i];
+		total += bdy_ram.nfree[i] << i;
+	}
+	st->nfail = pm_nfail;
+	mutex_unlock(&ram_map_lock);
+
+	st->free = total;
+	usable = total;
+	for (i = 0; i < PM_UNIT_MAX; ++i) {
+		st->frag[i] = total ? 1000 - usable * 1000 / total : 0;
+		usable -= st->nfree[i] << i;
+	}
+}
+
+/* One row per unit: the free blocks, the blocks allocated and freed since
+ * boot, and the fragmentation index. All the numbers are in hex.
+ */
+_ctx_proc
+void pm_ram_stats_dump()
+{
+	int i;
+	struct pm_ram_stats st;
+
+	pm_ram_stats(&st);
+
+	uart_send_str("pm unit nfree nalloc nfreed frag\r\n");
+	for (i = 0; i < PM_UNIT_MAX; ++i) {
+		uart_send_hex(i);
+		uart_send(' ');
+		uart_send_hex(st.nfree[i]);
+		uart_send(' ');
+		uart_send_hex(st.nalloc[i]);
+		uart_send(' ');
+		uart_send_hex(st.nfreed[i]);
+		uart_send(' ');
+		uart_send_num(st.frag[i]);
+	}
+	uart_send_str("pm free pages, failed allocs: ");
+	uart_send_hex(st.free);
+	uart_send(' ');
+	uart_send_num(st.nfail);
 }
@@ -23,6 +23,11 @@ _schedule:
 	push	{r2, r3}
 	str	sp, [r1];
 
+	/* An LDREX of the outgoing thread must not pair with a STREX
+	 * of the incoming one.
+	 */
+	clrex
+
 	ldr	sp, [r0];
 	pop	{r2, r3}
 	msr	cpsr, r3
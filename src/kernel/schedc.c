@@ -18,6 +18,7 @@
 #include <assert.h>
 #include <irq.h>
 #include <mmu.h>
+#include <pm.h>
 #include <slub.h>
 #include <string.h>
 #include <mutex.h>
@@ -29,6 +30,7 @@ static struct list_head ready;
 struct thread *current;
 static struct thread *idle;
 static struct thread _current;
+static struct kmem_cache *thread_cache;
 
 static struct list_head timer_heads[SCHED_MAX_TOUT_TICKS];
 static uint32_t timer_req_mask, timer_recv_mask;
@@ -268,11 +270,16 @@ struct thread *sched_thread_create(thread_fn fn, void *data)
 	struct thread *t;
 	struct context *ctx;
 
-	t = kmalloc(sizeof(*t));
-	memset(t, 0, sizeof(*t));
+	t = kmem_cache_alloc(thread_cache);
+	if (t == NULL)
+		return NULL;
 
+	t->usr_stack_hi = NULL;
 	t->ticks = THRD_QUOTA;
 	t->state = THRD_STATE_READY;
+	t->in_irq_ctx = 0;
+	t->irq_soft_count = 0;
+	t->irq_sched_count = 0;
 	t->svc_stack_hi = kmalloc(PAGE_SIZE) + PAGE_SIZE;
 
 	ctx = t->svc_stack_hi - sizeof(*ctx);
@@ -294,8 +301,13 @@ static int sched_idle(void *data)
 {
 	(void)data;
 
-	while (1)
-		wfi();
+	/* Keep the pool of pre-zeroed pages filled. Sleep when there is
+	 * nothing left to zero.
+	 */
+	while (1) {
+		if (pm_ram_prezero())
+			wfi();
+	}
 
 	return 0;
 }
@@ -323,6 +335,22 @@ void mutex_lock(struct mutex *m)
 	/* preempt_enable() provides release semantics. */
 }
 
+/* Returns 0 if the mutex was acquired. Never sleeps. */
+_ctx_proc
+int mutex_trylock(struct mutex *m)
+{
+	int ret;
+
+	preempt_disable();
+	ret = -1;
+	if (m->lock == 0) {
+		m->lock = 1;
+		ret = 0;
+	}
+	preempt_enable();
+	return ret;
+}
+
 _ctx_proc
 void mutex_unlock(struct mutex *m)
 {
@@ -447,6 +475,9 @@ void sched_init()
 {
 	int i;
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread), 0,
+					 NULL);
+
 	init_list_head(&ready);
 	for (i = 0; i < SCHED_MAX_TOUT_TICKS; ++i)
 		init_list_head(&timer_heads[i]);
@@ -16,6 +16,7 @@
  */
 
 #include <assert.h>
+#include <irq.h>
 #include <mmu.h>
 #include <pm.h>
 #include <slub.h>
@@ -24,54 +25,93 @@
 #include <vm.h>
 #include <mutex.h>
 
-#define SLUB_NSIZES		24
-#define SLUB_SUBPAGE_NSIZES	 9
-#define SLUB_FULLPAGE_NSIZES	(SLUB_NSIZES - SLUB_SUBPAGE_NSIZES)
+#include <sched.h>
+#include <uart.h>
 
-#define SLUB_SUBPAGE_START	 3
+#include <sys/sched.h>
+#include <sys/vm.h>
 
-/*
-static const size_t slub_alloc_sizes[SLUB_NSIZES] = {
+#define SLUB_SUBPAGE_NSIZES	16
+#define SLUB_FULLPAGE_NSIZES	15
+#define SLUB_NSIZES		(SLUB_SUBPAGE_NSIZES + SLUB_FULLPAGE_NSIZES)
+
+/* The number of 16MB blocks in the largest fullpage size. */
+#define SLUB_FULLPAGE_NBLKS	(1 << (SLUB_FULLPAGE_NSIZES - 1 -	\
+				       PM_UNIT_SUPER_SECTION))
+
+/* The subpage sizes are the powers of two, and, from 24 to 1536, the sizes
+ * half-way between them. A 16KB slab holds ten 1536-byte objects against
+ * eight of 2048.
+ */
+static const uint16_t slub_subpage_sizes[SLUB_SUBPAGE_NSIZES] = {
 	8,
 	16,
+	24,
 	32,
+	48,
 	64,
+	96,
 	128,
+	192,
 	256,
+	384,
 	512,
+	768,
 	1024,
-	2 * 1024,
-	4 * 1024,
-	8 * 1024,
-	16 * 1024,
-	32 * 1024,
-	64 * 1024,
-	128 * 1024,
-	256 * 1024,
-	512 * 1024,
-	1024 * 1024,
-	2 * 1024 * 1024,
-	4 * 1024 * 1024,
-	8 * 1024 * 1024,
-	16 * 1024 * 1024,
-	32 * 1024 * 1024,
-	64 * 1024 * 1024,
+	1536,
+	2048,
 };
-*/
 
-/* Handles subpage allocations. */
+/* The index of the subpage size 1 << i, for i in [3, 11]. */
+static const int8_t slub_pow2_sizes[] = {
+	0, 1, 3, 5, 7, 9, 11, 13, 15,
+};
+
+/* A subpage slab is a naturally aligned 16KB block, so that a refill is a
+ * single vm_alloc(), pm_ram_alloc() and mmu_map(), and needs no colour.
+ */
+#define SLUB_SLAB_UNIT		PM_UNIT_16KB
+#define SLUB_SLAB_VM_UNIT	VM_UNIT_16KB
+#define SLUB_SLAB_NPAGES	(1 << SLUB_SLAB_UNIT)
+#define SLUB_SLAB_SIZE_SZ	(PAGE_SIZE_SZ + SLUB_SLAB_UNIT)
+#define SLUB_SLAB_SIZE		(1u << SLUB_SLAB_SIZE_SZ)
+#define SLUB_SLAB_SIZE_MASK	(SLUB_SLAB_SIZE - 1)
+
+/* The VA table entries of the PT pages. */
+#define SLUB_SIZE_PT		SLUB_NSIZES
+
+/* The index of an object from its offset in the slab, without a
+ * division. Exact for any multiple of sz below 1 << SLUB_RECIP_SHIFT, so
+ * for any offset into a slab. The product fits 32 bits: the recip is at
+ * most 1 << 16, for the 4-byte kmem objects, whose offsets are below
+ * PAGE_SIZE, and at most 1 << 15 for the subpage sizes, whose offsets are
+ * below SLUB_SLAB_SIZE.
+ */
+#define SLUB_RECIP_SHIFT	18
+
+static inline uint32_t slub_recip(uint32_t sz)
+{
+	return ((1u << SLUB_RECIP_SHIFT) + sz - 1) / sz;
+}
+
+/* Handles subpage allocations. The headers live apart from the slabs, in
+ * slub_slabs, indexed by the VA of the slab.
+ */
 struct subpage_slab {
 	struct list_head entry;
 	uint16_t nfree;
 	uint16_t free;
-	/* PAGE_SIZE aligned pointer. */
+	uint16_t colour;	/* Offset of the first object. */
+	/* SLUB_SLAB_SIZE aligned pointer. */
 	void *p;
+	uintptr_t pa;
 };
 
 /* Handles full page allocations. */
 struct fullpage_slab {
 	struct list_head entry;
 	void *p;
+	uintptr_t pa;		/* Of the first block. */
 };
 
 struct subpage {
@@ -79,7 +119,14 @@ struct subpage {
 	struct list_head part;
 	struct list_head free;
 	struct mutex lock;
-	int log_sz;
+	int sz;
+	int nobjs;		/* Per slab. */
+	uint32_t recip;		/* slub_recip(sz). */
+	int nfree_slabs;	/* On the free list. */
+	int nbusy_slabs;	/* On the busy list. */
+	int nslabs;
+	uint16_t slack;		/* Bytes past the last object. */
+	uint16_t colour;	/* Of the next slab. */
 };
 
 /* full page allocations are all consider busy. */
@@ -89,14 +136,6 @@ struct fullpage {
 	int log_sz;
 };
 
-
-/* This variable is used to monitor the usage of the 16byte slabs.
- * If the number of free items are quite less, we need to use one
- * of them to allocate a struct slab to avoid deadlock of
- * needing a 16byte allocation to allocate a 16byte allocation.
- */
-static int slub_16byte_free;
-
 /* struct page va field. */
 #define SLUB_LEADER_POS		 0
 #define SLUB_LEADER_SZ		 1
@@ -110,33 +149,448 @@ static struct subpage_slab mmu_pt_slab;
 static struct subpage mmu_pt_subpages;
 static struct subpage subpages[SLUB_SUBPAGE_NSIZES];
 static struct fullpage fullpages[SLUB_FULLPAGE_NSIZES];
+static struct kmem_cache *fullpage_slab_cache;
+
+/* The slab owning each page of the VMA_SLUB area, and each section of the
+ * VMA_SLUB_SECTION area, so that kfree() needs neither a PD walk nor the
+ * ram_map. A fullpage allocation is entered at its first page alone.
+ */
+struct slub_va {
+	void *sl;		/* struct subpage_slab or fullpage_slab. */
+	int size;		/* Index into subpages, then fullpages. */
+};
+
+#define SLUB_VA_NPAGES		(VM_AREA_SIZE >> PAGE_SIZE_SZ)
+#define SLUB_VA_NSECTIONS	(VM_AREA_SIZE >> (PAGE_SIZE_SZ + PM_UNIT_SECTION))
+
+static struct slub_va slub_va_pages[SLUB_VA_NPAGES];
+static struct slub_va slub_va_sections[SLUB_VA_NSECTIONS];
+static struct slub_va slub_va_mmu;	/* The slab at mmu_slub_area. */
+
+/* The header of each subpage slab the VMA_SLUB area can hold. */
+static struct subpage_slab slub_slabs[SLUB_VA_NPAGES >> SLUB_SLAB_UNIT];
+
+/* Stacks of free objects, one per subpage size, in front of the slabs.
+ * With a single CPU, they are per-CPU by construction, and disabling the
+ * preemption protects them. They are filled and drained a batch at a
+ * time, under one acquisition of the class lock.
+ */
+#define SLUB_MAG_SZ		16
+#define SLUB_MAG_BATCH		(SLUB_MAG_SZ >> 1)
+
+struct slub_mag {
+	int n;
+	void *objs[SLUB_MAG_SZ];
+};
+
+static struct slub_mag slub_mags[SLUB_SUBPAGE_NSIZES];
+
+/* Always-on counters of each size, updated with preemption disabled. The
+ * objects handed out less those given back are those in use. The subpage
+ * sizes also sum the bytes wasted by the last nwaste allocations; both
+ * halve when nwaste reaches SLUB_STATS_DECAY, so that the sum cannot
+ * overflow.
+ */
+#define SLUB_STATS_DECAY	(1 << 16)
+
+struct slub_stats {
+	uint32_t nalloc;
+	uint32_t nfree;
+	uint32_t nwaste;
+	uint32_t waste;
+};
+
+static struct slub_stats slub_stats[SLUB_NSIZES];
+
+/* Emergency reserves, one per subpage size, for kmalloc_atomic(). Refilled
+ * up to SLUB_RSV_SZ once one falls below SLUB_RSV_LOW.
+ */
+#define SLUB_RSV_SZ		4
+#define SLUB_RSV_LOW		2
+
+struct slub_rsv {
+	int n;
+	uint32_t nalloc;	/* Counted apart, with IRQs disabled. */
+	void *objs[SLUB_RSV_SZ];
+};
+
+static struct slub_rsv slub_rsvs[SLUB_SUBPAGE_NSIZES];
+static struct list_head slub_rsv_wq;
+static int slub_rsv_cond;
+
+/* The free slabs a size keeps. Past SLUB_FREE_HIGH, the frees give the
+ * pages back down to SLUB_FREE_LOW. The shrinker gives them all back.
+ */
+#define SLUB_FREE_LOW		1
+#define SLUB_FREE_HIGH		4
+
+static struct pm_shrinker slub_shrinker;
+
+/* Typed object caches. Each slab is a single page, which ends with its
+ * struct kmem_slab and the array of free indices. The objects themselves
+ * hold no allocator state, so that they stay in their constructed state
+ * while free. As with the subpage slabs, the objects start at the colour
+ * of the slab.
+ */
+struct kmem_cache {
+	struct list_head busy;
+	struct list_head part;
+	struct list_head free;
+	struct mutex lock;
+	kmem_ctor ctor;
+	const char *name;
+	uint16_t sz;		/* Stride of the objects. */
+	uint16_t nobjs;		/* Objects per slab. */
+	uint16_t off;		/* Offset of struct kmem_slab. */
+	uint16_t slack;
+	uint16_t colour;	/* Of the next slab. */
+	uint32_t recip;		/* slub_recip(sz). */
+	int nfree_slabs;	/* On the free list. */
+};
+
+/* The free slabs a cache keeps. The page of any other slab which empties
+ * goes back to pm, and its VA back to vm.
+ */
+#define KMEM_FREE_MAX		1
+
+struct kmem_slab {
+	struct list_head entry;
+	uint16_t nfree;
+	uint16_t free;
+	uint16_t colour;
+	uint16_t next[];
+};
+
+static struct slub_va *slub_va_get(const void *p)
+{
+	uintptr_t i;
+	extern char vm_slub_start;
+	extern char vm_slub_section_start;
+	extern char mmu_slub_area;
+
+	i = ((uintptr_t)p - (uintptr_t)&vm_slub_start) >> PAGE_SIZE_SZ;
+	if (i < SLUB_VA_NPAGES)
+		return &slub_va_pages[i];
+
+	i = (uintptr_t)p - (uintptr_t)&vm_slub_section_start;
+	i >>= PAGE_SIZE_SZ + PM_UNIT_SECTION;
+	if (i < SLUB_VA_NSECTIONS)
+		return &slub_va_sections[i];
+
+	if (ALIGN_DN((uintptr_t)p, SLUB_SLAB_SIZE) == (uintptr_t)&mmu_slub_area)
+		return &slub_va_mmu;
+	return NULL;
+}
+
+static void slub_va_set(const void *p, void *sl, int size)
+{
+	struct slub_va *v;
+
+	v = slub_va_get(p);
+	assert(v);
+	v->sl = sl;
+	v->size = size;
+}
+
+/* A subpage slab is entered at each of its pages. */
+static void slub_va_set_slab(void *p, void *sl, int size)
+{
+	int i;
+
+	for (i = 0; i < SLUB_SLAB_NPAGES; ++i)
+		slub_va_set(p + (i << PAGE_SIZE_SZ), sl, size);
+}
+
+static struct subpage_slab *slub_slab_of(const void *p)
+{
+	uintptr_t i;
+	extern char vm_slub_start;
+
+	i = ((uintptr_t)p - (uintptr_t)&vm_slub_start) >> SLUB_SLAB_SIZE_SZ;
+	assert(i < ARRAY_SIZE(slub_slabs));
+	return &slub_slabs[i];
+}
 
-static void slub_subpage_init0(struct subpage *sp, int log_sz)
+/* Objects at the same offset of each slab fall into the same L1 sets. The
+ * first object of each new slab is thus placed a cache line further into
+ * the slack of the slab, wrapping around past its end. The colours are
+ * whole cache lines.
+ */
+static int slub_colour_next(uint16_t *colour, int slack)
 {
-	sp->log_sz = log_sz;
+	int c;
+
+	c = *colour;
+	*colour += 1 << CACHE_LINE_SIZE_SZ;
+	if (*colour > slack)
+		*colour = 0;
+	return c;
+}
+
+static void slub_subpage_init0(struct subpage *sp, int sz)
+{
+	sp->sz = sz;
+	sp->nobjs = SLUB_SLAB_SIZE / sz;
+	sp->recip = slub_recip(sz);
+	sp->slack = SLUB_SLAB_SIZE - sp->nobjs * sz;
+#ifdef SLUB_NO_COLOUR
+	sp->slack = 0;
+#endif
+	sp->colour = 0;
 	init_list_head(&sp->busy);
 	init_list_head(&sp->part);
 	init_list_head(&sp->free);
 	mutex_init(&sp->lock);
+	sp->nfree_slabs = 0;
+	sp->nbusy_slabs = 0;
+	sp->nslabs = 0;
 }
 
-static void slub_map(void *va, uintptr_t pa)
+static void slub_map(void *va, uintptr_t pa, enum mmu_map_unit mu, int n,
+		     char map)
 {
 	int ret;
 	struct mmu_map_req r;
 
-	r.n = 1;
+	r.n = n;
 	r.mt = MT_NRM_IO_WBA;
 	r.ap = AP_SRW;
-	r.mu = MAP_UNIT_PAGE;
+	r.mu = mu;
 	r.flags  = bits_on(MMR_XN);
 	r.flags |= bits_on(MMR_AF);	/* Prevent access faults. */
 	r.va_start = va;
 	r.pa_start = pa;
 
-	ret = mmu_map(&r);
+	/* The pages were allocated with PMA_ZERO. */
+	if (map)
+		ret = mmu_map(&r);
+	else
+		ret = mmu_unmap(&r);
+	assert(ret == 0);
+}
+
+/* The slab pages of the caches are pages of the VMA_SLUB area, as the
+ * subpage slabs are blocks of it; the caches grow as long as the area and
+ * the RAM last. Their slub_va entries stay without a slab, so kfree()
+ * rejects the objects. Returns NULL once the area or the RAM runs out.
+ */
+_ctx_proc
+static void *kmem_page_alloc()
+{
+	int ret;
+	void *va;
+	uintptr_t pa;
+
+	ret = vm_alloc(VMA_SLUB, VM_UNIT_PAGE, 1, &va);
+	if (ret)
+		return NULL;
+
+	ret = pm_ram_alloc(PM_UNIT_PAGE, PGF_USE_SLUB,
+			   bits_on(PMA_ZERO) | pm_colour_of(va), 1, &pa);
+	if (ret) {
+		ret = vm_free(VMA_SLUB, VM_UNIT_PAGE, 1, (const void **)&va);
+		assert(ret == 0);
+		return NULL;
+	}
+
+	slub_map(va, pa, MAP_UNIT_PAGE, 1, 1);
+	return va;
+}
+
+_ctx_proc
+static void kmem_page_free(void *va)
+{
+	int ret;
+	uintptr_t pa;
+
+	pa = mmu_va_to_pa(va);
+	slub_map(va, pa, MAP_UNIT_PAGE, 1, 0);
+
+	ret = pm_ram_free(PM_UNIT_PAGE, PGF_USE_SLUB, 1, &pa);
+	assert(ret == 0);
+
+	ret = vm_free(VMA_SLUB, VM_UNIT_PAGE, 1, (const void **)&va);
 	assert(ret == 0);
-	memset(va, 0, PAGE_SIZE);
+}
+
+_ctx_proc
+static struct kmem_slab *kmem_slab_create(struct kmem_cache *c, int colour)
+{
+	int i;
+	void *p;
+	struct kmem_slab *sl;
+
+	p = kmem_page_alloc();
+	if (p == NULL)
+		return NULL;
+
+	sl = p + c->off;
+	sl->nfree = c->nobjs;
+	sl->free = 0;
+	sl->colour = colour;
+	for (i = 0; i < c->nobjs; ++i)
+		sl->next[i] = i + 1;
+
+	p += colour;
+	if (c->ctor)
+		for (i = 0; i < c->nobjs; ++i)
+			c->ctor(p + i * c->sz);
+	return sl;
+}
+
+_ctx_proc
+struct kmem_cache *kmem_cache_create(const char *name, size_t sz,
+				     size_t align, kmem_ctor ctor)
+{
+	size_t n;
+	struct kmem_cache *c;
+
+	if (align < sizeof(uint32_t))
+		align = sizeof(uint32_t);
+	assert((align & (align - 1)) == 0 && align < PAGE_SIZE);
+	assert(sz);
+
+	sz = ALIGN_UP(sz, align);
+
+	/* Each object costs its stride and a free index. */
+	n = PAGE_SIZE - sizeof(struct kmem_slab) - sizeof(uint32_t);
+	n /= sz + sizeof(uint16_t);
+	assert(n);
+
+	c = kmalloc(sizeof(*c));
+	assert(c);
+
+	init_list_head(&c->busy);
+	init_list_head(&c->part);
+	init_list_head(&c->free);
+	mutex_init(&c->lock);
+	c->ctor = ctor;
+	c->name = name;
+	c->sz = sz;
+	c->nobjs = n;
+	c->off = PAGE_SIZE - sizeof(struct kmem_slab) - n * sizeof(uint16_t);
+	c->off = ALIGN_DN(c->off, sizeof(uint32_t));
+	c->recip = slub_recip(sz);
+	assert(c->off >= n * sz);
+
+	/* A colour which is not a multiple of align would misalign the
+	 * objects.
+	 */
+	c->slack = c->off - n * sz;
+	if (align > CACHE_LINE_SIZE)
+		c->slack = 0;
+#ifdef SLUB_NO_COLOUR
+	c->slack = 0;
+#endif
+	c->colour = 0;
+	c->nfree_slabs = 0;
+	return c;
+}
+
+_ctx_proc
+void *kmem_cache_alloc(struct kmem_cache *c)
+{
+	int j, colour;
+	void *p;
+	struct kmem_slab *sl;
+	struct list_head *h, *nh;
+
+	mutex_lock(&c->lock);
+	while (1) {
+		h = &c->part;
+		if (!list_empty(h))
+			break;
+		h = &c->free;
+		if (!list_empty(h))
+			break;
+
+		/* Mapping the new slab may need a PT, and so an allocation
+		 * from another cache. Do not hold the lock across it.
+		 */
+		colour = slub_colour_next(&c->colour, c->slack);
+		mutex_unlock(&c->lock);
+		sl = kmem_slab_create(c, colour);
+		if (sl == NULL)
+			return NULL;
+
+		mutex_lock(&c->lock);
+		list_add_tail(&sl->entry, &c->free);
+		++c->nfree_slabs;
+	}
+
+	sl = list_entry(h->next, struct kmem_slab, entry);
+	if (h == &c->free)
+		--c->nfree_slabs;
+
+	j = sl->free;
+	assert(j < c->nobjs);
+	sl->free = sl->next[j];
+	--sl->nfree;
+
+	nh = NULL;
+	if (sl->nfree == 0)
+		nh = &c->busy;
+	else if (sl->nfree == c->nobjs - 1)
+		nh = &c->part;
+
+	if (nh) {
+		list_del(&sl->entry);
+		list_add(&sl->entry, nh);
+	}
+	mutex_unlock(&c->lock);
+
+	p = (void *)((uintptr_t)sl & ~PAGE_SIZE_MASK);
+	return p + sl->colour + j * c->sz;
+}
+
+_ctx_proc
+void kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	uintptr_t j, off;
+	struct kmem_slab *sl;
+	struct list_head *nh;
+
+	off = (uintptr_t)p & PAGE_SIZE_MASK;
+	sl = p - off + c->off;
+
+	assert(off >= sl->colour);
+	off -= sl->colour;
+	j = (off * c->recip) >> SLUB_RECIP_SHIFT;
+	assert(j < c->nobjs && j * c->sz == off);
+
+	mutex_lock(&c->lock);
+	sl->next[j] = sl->free;
+	sl->free = j;
+	++sl->nfree;
+	assert(sl->nfree <= c->nobjs);
+
+	nh = NULL;
+	if (sl->nfree == c->nobjs && c->nfree_slabs >= KMEM_FREE_MAX) {
+		list_del(&sl->entry);
+		mutex_unlock(&c->lock);
+		kmem_page_free(p - off - sl->colour);
+		return;
+	}
+
+	if (sl->nfree == c->nobjs) {
+		nh = &c->free;
+		++c->nfree_slabs;
+	} else if (sl->nfree == 1) {
+		nh = &c->part;
+	}
+
+	if (nh) {
+		list_del(&sl->entry);
+		list_add(&sl->entry, nh);
+	}
+	mutex_unlock(&c->lock);
+}
+
+static int slub_size_of(const struct subpage *sp)
+{
+	if (sp == &mmu_pt_subpages)
+		return SLUB_SIZE_PT;
+	return sp - subpages;
 }
 
 static void slub_subpage_init1(struct subpage *sp, struct subpage_slab *sl,
@@ -151,54 +605,46 @@ static void slub_subpage_init1(struct subpage *sp, struct subpage_slab *sl,
 
 	assert(pg);
 	assert(bits_get(pg->flags, PGF_USE) == PGF_USE_SLUB);
-	assert(bits_get(pg->flags, PGF_UNIT) == PM_UNIT_PAGE);
+	assert(bits_get(pg->flags, PGF_UNIT) == SLUB_SLAB_UNIT);
 
-	/* Save the log(sz of the allocation unit). */
-	pg->flags |= bits_set(PGF_SLUB_LSIZE, sp->log_sz);
+	/* Save the log(sz of the allocation unit), rounded up. The block
+	 * may have been a kmalloc() block, with a size set already.
+	 */
+	pg->flags &= bits_off(PGF_SLUB_LSIZE);
+	pg->flags |= bits_set(PGF_SLUB_LSIZE, 32 - bits_clz(sp->sz - 1));
 	pg->u0.va  = (void *)((uintptr_t)sl | bits_on(SLUB_LEADER));
+	slub_va_set_slab(va, sl, slub_size_of(sp));
 
 	sl->p = va;
-	t = (uintptr_t)sl->p;
-	n = PAGE_SIZE >> sp->log_sz;
-	sz = 1 << sp->log_sz;
-
-	/* subpages[1] is the slab responsible for 16byte allocations,
-	 * which also happens to be the size of struct slab.
-	 */
-	if (sp->log_sz == 4) {
-		/* We use up 9 struct slab elements straight away. */
-		i = SLUB_SUBPAGE_NSIZES;
-		sl->nfree = n - i;
-		slub_16byte_free += sl->nfree;
-		sl->free = i;
-		t += i << sp->log_sz;
-		list_add_tail(&sl->entry, &sp->part);
-	} else {
-		i = 0;
-		sl->free = 0;
-		sl->nfree = n;
-		list_add_tail(&sl->entry, &sp->free);
-	}
+	sl->pa = pa;
+	sl->colour = slub_colour_next(&sp->colour, sp->slack);
+	sl->free = 0;
+	sl->nfree = sp->nobjs;
+	list_add_tail(&sl->entry, &sp->free);
+	++sp->nfree_slabs;
+	++sp->nslabs;
 
 	/* Initialize the free list. */
-	for (i = i; i < n; ++i, t += sz)
+	t = (uintptr_t)sl->p + sl->colour;
+	n = sp->nobjs;
+	sz = sp->sz;
+	for (i = 0; i < n; ++i, t += sz)
 		*(uint32_t *)t = i + 1;
 }
 
-/* For each of the 9 sizes, we allocate one page as the data page
- * p[0]. The struct slab for each of the 9 sizes are allocated
- * from p[1], the 16 byte slab.
+/* For each of the subpage sizes, we allocate one slab, mapped at the end
+ * of the vm_slub area. The headers are in slub_slabs already.
  */
 void slub_init()
 {
 	int i, ret;
-	struct subpage_slab *sl;
 	uintptr_t pa[SLUB_SUBPAGE_NSIZES];
-	void *va[SLUB_SUBPAGE_NSIZES];
+	void *va;
 	extern char vm_slub_end;
 	extern char mmu_slub_area;
 
-	assert(sizeof(struct subpage_slab) == 16);
+	assert(VM_SLUB_NBOOT == SLUB_SUBPAGE_NSIZES);
+	assert(VM_SLUB_BOOT_UNIT == SLUB_SLAB_VM_UNIT);
 
 	for (i = 0; i < SLUB_FULLPAGE_NSIZES; ++i) {
 		fullpages[i].log_sz = PAGE_SIZE_SZ + i;
@@ -209,102 +655,214 @@ void slub_init()
 	/* We need 0x400-byte allocations for the mmu to allocate PTs.
 	 * The allocations come from a separate subpage instance. That
 	 * subpage instance must be initialized first.
-	 * For that, we get a slab page and map it to a va for which
+	 * For that, we get a slab and map it to a va for which
 	 * the PTE resides in the kernel PT k_pt.
 	 */
-	ret = pm_ram_alloc(PM_UNIT_PAGE, PGF_USE_SLUB, 1, pa);
+	va = &mmu_slub_area;
+	ret = pm_ram_alloc(SLUB_SLAB_UNIT, PGF_USE_SLUB, bits_on(PMA_ZERO), 1,
+			   pa);
 	assert(ret == 0);
-	va[0] = &mmu_slub_area;
 
 	/* The mmu_map must succeed without it needing to call back
 	 * into slub() for allocating a PT.
 	 *
-	 * (1 << 10) == 0x400.
 	 */
-	slub_subpage_init0(&mmu_pt_subpages, SLUB_SUBPAGE_START + 7);
-	slub_map(va[0], pa[0]);
-	slub_subpage_init1(&mmu_pt_subpages, &mmu_pt_slab, va[0], pa[0]);
+	slub_subpage_init0(&mmu_pt_subpages, 0x400);
+	slub_map(va, pa[0], MAP_UNIT_PAGE, SLUB_SLAB_NPAGES, 1);
+	slub_subpage_init1(&mmu_pt_subpages, &mmu_pt_slab, va, pa[0]);
 
 
 	/* Any mmu_map() calls which require allocation of PTs can now
 	 * work.
 	 */
 
-	ret = pm_ram_alloc(PM_UNIT_PAGE, PGF_USE_SLUB, SLUB_SUBPAGE_NSIZES, pa);
+	ret = pm_ram_alloc(SLUB_SLAB_UNIT, PGF_USE_SLUB, bits_on(PMA_ZERO),
+			   SLUB_SUBPAGE_NSIZES, pa);
 	assert(ret == 0);
 
-	va[0] = &vm_slub_end - (SLUB_SUBPAGE_NSIZES << PAGE_SIZE_SZ);
+	for (i = 0; i < SLUB_SUBPAGE_NSIZES; ++i)
+		slub_subpage_init0(&subpages[i], slub_subpage_sizes[i]);
 
-	/* Map the initial slub pages at the end of the vm_slub area. */
-	for (i = 1; i < SLUB_SUBPAGE_NSIZES; ++i)
-		va[i] = va[i - 1] + PAGE_SIZE;
-
-	for (i = 0; i < SLUB_SUBPAGE_NSIZES; ++i) {
-		slub_subpage_init0(&subpages[i], SLUB_SUBPAGE_START + i);
-		slub_map(va[i], pa[i]);
+	/* Map the initial slabs at the end of the vm_slub area. */
+	va = &vm_slub_end - (SLUB_SUBPAGE_NSIZES << SLUB_SLAB_SIZE_SZ);
+	for (i = 0; i < SLUB_SUBPAGE_NSIZES; ++i, va += SLUB_SLAB_SIZE) {
+		slub_map(va, pa[i], MAP_UNIT_PAGE, SLUB_SLAB_NPAGES, 1);
+		slub_subpage_init1(&subpages[i], slub_slab_of(va), va, pa[i]);
 	}
 
-	for (i = 0; i < SLUB_SUBPAGE_NSIZES; ++i) {
-		sl = va[1];
-		sl += i;
-		slub_subpage_init1(&subpages[i], sl, va[i], pa[i]);
-	}
+	fullpage_slab_cache = kmem_cache_create("fullpage_slab",
+						sizeof(struct fullpage_slab),
+						0, NULL);
 }
 
 /* Must be at process context. */
+/* A slab of the VMA_SLUB area. Being a multiple of the colour span, it
+ * needs no colour.
+ */
+_ctx_proc
+static void *slub_slab_alloc(uintptr_t *pa)
+{
+	int ret;
+	void *p;
+
+	ret = vm_alloc(VMA_SLUB, SLUB_SLAB_VM_UNIT, 1, &p);
+	assert(ret == 0);
+
+	ret = pm_ram_alloc(SLUB_SLAB_UNIT, PGF_USE_SLUB, bits_on(PMA_ZERO), 1,
+			   pa);
+	assert(ret == 0);
+
+	slub_map(p, *pa, MAP_UNIT_PAGE, SLUB_SLAB_NPAGES, 1);
+	return p;
+}
+
+_ctx_proc
+static void slub_slab_free(void *p, uintptr_t pa)
+{
+	int ret;
+
+	slub_map(p, pa, MAP_UNIT_PAGE, SLUB_SLAB_NPAGES, 0);
+
+	ret = pm_ram_free(SLUB_SLAB_UNIT, PGF_USE_SLUB, 1, &pa);
+	assert(ret == 0);
+
+	ret = vm_free(VMA_SLUB, SLUB_SLAB_VM_UNIT, 1, (const void **)&p);
+	assert(ret == 0);
+}
+
+/* Called with the class lock held. The header is found from the VA, so
+ * a refill allocates from no other size.
+ */
 static void slub_alloc_subpage_slab(struct subpage *sp)
 {
 	void *p;
-	struct subpage_slab *sl;
 	uintptr_t pa;
 
-	/* Allocate a struct slab and a data page. */
-	sl = kmalloc(sizeof(*sl));
-	assert(sl);
-	memset(sl, 0, sizeof(*sl));
+	p = slub_slab_alloc(&pa);
+	slub_subpage_init1(sp, slub_slab_of(p), p, pa);
+}
+
+/* Called with the class lock held. Moves the free slabs above low over to
+ * h, to be released once the lock is dropped.
+ */
+static void slub_trim(struct subpage *sp, int low, struct list_head *h)
+{
+	struct subpage_slab *sl;
 
-	p = kmalloc(PAGE_SIZE);
-	assert(p);
-	memset(p, 0, PAGE_SIZE);
+	while (sp->nfree_slabs > low) {
+		assert(!list_empty(&sp->free));
+		sl = list_entry(sp->free.prev, struct subpage_slab, entry);
+		list_del(&sl->entry);
+		list_add(&sl->entry, h);
+		--sp->nfree_slabs;
+		--sp->nslabs;
+		slub_va_set_slab(sl->p, NULL, 0);
+	}
+}
 
-	pa = mmu_va_to_pa(p);
-	assert(pa != 0xffffffff);
+_ctx_proc
+static int slub_release(struct list_head *h)
+{
+	int n;
+	struct subpage_slab *sl;
 
-	slub_subpage_init1(sp, sl, p, pa);
+	n = 0;
+	while (!list_empty(h)) {
+		sl = list_entry(h->next, struct subpage_slab, entry);
+		list_del(&sl->entry);
+		slub_slab_free(sl->p, sl->pa);
+		++n;
+	}
+	return n;
+}
+
+/* The largest mmu_map_unit which fits within a block of the pm unit. */
+static enum mmu_map_unit slub_map_unit(enum pm_alloc_units unit)
+{
+	if (unit >= PM_UNIT_SUPER_SECTION)
+		return MAP_UNIT_SUPER_SECTION;
+	if (unit >= PM_UNIT_SECTION)
+		return MAP_UNIT_SECTION;
+	if (unit >= PM_UNIT_LARGE_PAGE)
+		return MAP_UNIT_LARGE_PAGE;
+	return MAP_UNIT_PAGE;
+}
+
+/* The log of the mmu_map_unit size, in pages. */
+static const enum pm_alloc_units slub_map_units[MAP_UNIT_MAX] = {
+	PM_UNIT_PAGE,
+	PM_UNIT_LARGE_PAGE,
+	PM_UNIT_SECTION,
+	PM_UNIT_SUPER_SECTION
+};
+
+/* The fullpage sizes map onto a single pm block up to PM_UNIT_16MB, which
+ * is the largest buddy order. The 32MB and 64MB sizes are runs of 16MB
+ * blocks, contiguous in VA alone.
+ */
+static void slub_fullpage_units(const struct fullpage *fp,
+				enum pm_alloc_units *unit, int *nblks)
+{
+	int i;
+
+	i = fp->log_sz - PAGE_SIZE_SZ;
+	*unit = i;
+	if (*unit > PM_UNIT_SUPER_SECTION)
+		*unit = PM_UNIT_SUPER_SECTION;
+	*nblks = 1 << (i - *unit);
+}
+
+/* Sizes from a section upwards are mapped with PDEs alone, and have their
+ * own VA area so that no PT ever sits in their way.
+ */
+static enum vm_area slub_fullpage_area(const struct fullpage *fp)
+{
+	if (fp->log_sz >= PAGE_SIZE_SZ + PM_UNIT_SECTION)
+		return VMA_SLUB_SECTION;
+	return VMA_SLUB;
 }
 
 static void *kmalloc_fullpages(struct fullpage *fp)
 {
-	int ret;
+	int i, ret, nblks, nmap, flags;
 	void *p;
 	struct page *pg;
-	uintptr_t pa;
+	enum pm_alloc_units unit;
+	enum mmu_map_unit mu;
+	uintptr_t pa[SLUB_FULLPAGE_NBLKS];
 	struct fullpage_slab *sl;
 
-	/* For now, only allocate single page. We also
-	 * need to track the allocations to support kfree().
-	 */
-	assert(fp->log_sz == PAGE_SIZE_SZ);
+	slub_fullpage_units(fp, &unit, &nblks);
+	mu = slub_map_unit(unit);
+	nmap = 1 << (unit - slub_map_units[mu]);
 
-	ret = vm_alloc(VMA_SLUB, VM_UNIT_PAGE, 1, &p);
+	/* The VA is naturally aligned, as are the blocks. */
+	ret = vm_alloc(slub_fullpage_area(fp), fp->log_sz - PAGE_SIZE_SZ, 1,
+		       &p);
 	assert(ret == 0);
 
-	ret = pm_ram_alloc(PM_UNIT_PAGE, PGF_USE_SLUB, 1, &pa);
+	/* The VA comes first, so that a single page can match its colour. */
+	flags = bits_on(PMA_ZERO);
+	if (unit == PM_UNIT_PAGE)
+		flags |= pm_colour_of(p);
+	ret = pm_ram_alloc(unit, PGF_USE_SLUB, flags, nblks, pa);
 	assert(ret == 0);
 
-	slub_map(p, pa);
+	for (i = 0; i < nblks; ++i)
+		slub_map(p + (i << (unit + PAGE_SIZE_SZ)), pa[i], mu, nmap, 1);
 
-	sl = kmalloc(sizeof(*sl));
+	sl = kmem_cache_alloc(fullpage_slab_cache);
 	assert(sl);
 	sl->p = p;
+	sl->pa = pa[0];
 
-	pg = pm_ram_get_page(pa);
+	pg = pm_ram_get_page(pa[0]);
 	assert(pg);
 
 	assert(bits_get(pg->flags, PGF_USE) == PGF_USE_SLUB);
 
 	/* The UNIT value depends on the index of allocation. */
-	assert(bits_get(pg->flags, PGF_UNIT) == PM_UNIT_PAGE);
+	assert(bits_get(pg->flags, PGF_UNIT) == unit);
 
 	/* For multiplage allocations, only the first page has
 	 * the LEADER bit set.
@@ -312,76 +870,238 @@ static void *kmalloc_fullpages(struct fullpage *fp)
 	pg->flags |= bits_set(PGF_SLUB_LSIZE, fp->log_sz);
 	pg->u0.va  = (void *)((uintptr_t)sl | bits_on(SLUB_LEADER));
 
+	slub_va_set(p, sl, SLUB_SUBPAGE_NSIZES + (fp - fullpages));
+
 	mutex_lock(&fp->lock);
 	list_add_tail(&sl->entry, &fp->busy);
+	++slub_stats[SLUB_SUBPAGE_NSIZES + (fp - fullpages)].nalloc;
 	mutex_unlock(&fp->lock);
 
 	return p;
 }
 
-static void *kmalloc_subpages(struct subpage *sp)
+/* Called with the class lock held. Carves up to n objects off the free
+ * chain of the first slab which has any, and moves the slab between the
+ * lists once. Returns the number of objects carved.
+ */
+static int _kmalloc_subpages_slab(struct subpage *sp, int n, void **objs)
 {
-	int n;
+	int i;
 	void *p;
 	uintptr_t va;
 	struct subpage_slab *sl;
 	struct list_head *h, *e, *nh;
 
-	mutex_lock(&sp->lock);
-
-	n = PAGE_SIZE >> sp->log_sz;
 	h = &sp->part;
 	e = NULL;
 	if (list_empty(h))
 		h = &sp->free;
 
-	if (list_empty(h)) {
-		/* If we are unable to find any free item, the size
-		 * which is now empty better not be the 16byte alloc
-		 * size.
-		 */
-		assert(sp->log_sz != 4);
+	if (list_empty(h))
 		slub_alloc_subpage_slab(sp);
-	}
 
 	assert(!list_empty(h));
 	e = h->next;
 
 	sl = list_entry(e, struct subpage_slab, entry);
 
-	/* Get the current free. */
-	va = (uintptr_t)sl->p;
-
-	/* Get the pointer to the corresponding object. */
-	p = (void *)(va + (sl->free << sp->log_sz));
-	sl->free = *(uint32_t *)p;
-	*(uint32_t *)p = 0;
-
 	nh = NULL;
-	if (sl->nfree == n)
+	if (sl->nfree == sp->nobjs) {
 		nh = &sp->part;
-	else if (sl->nfree == 1)
+		--sp->nfree_slabs;
+	}
+
+	if (n >= sl->nfree) {
+		n = sl->nfree;
 		nh = &sp->busy;
+		++sp->nbusy_slabs;
+	}
 
-	--sl->nfree;
-	assert(sl->nfree < n);
+	/* Walk the free chain. */
+	va = (uintptr_t)sl->p + sl->colour;
+	for (i = 0; i < n; ++i) {
+		p = (void *)(va + sl->free * sp->sz);
+		sl->free = *(uint32_t *)p;
+		*(uint32_t *)p = 0;
+		objs[i] = p;
+	}
+	sl->nfree -= n;
 
 	if (nh) {
 		list_del(e);
 		list_add(e, nh);
 	}
+	return n;
+}
 
-	if (sp->log_sz == 4) {
-		--slub_16byte_free;
-		if (slub_16byte_free == 4)
-			slub_alloc_subpage_slab(sp);
-	}
+/* Carves n objects under a single acquisition of the class lock, a slab
+ * at a time.
+ */
+static void kmalloc_subpages_batch(struct subpage *sp, int n, void **objs)
+{
+	int i;
+
+	mutex_lock(&sp->lock);
+	for (i = 0; i < n;)
+		i += _kmalloc_subpages_slab(sp, n - i, &objs[i]);
 	mutex_unlock(&sp->lock);
+}
+
+static void *kmalloc_subpages(struct subpage *sp)
+{
+	void *p;
 
-	assert(p);
+	kmalloc_subpages_batch(sp, 1, &p);
 	return p;
 }
 
+/* Called with the class lock held. */
+static void _kfree_subpages(void *p, struct subpage *sp,
+			    struct subpage_slab *sl)
+{
+	int n;
+	uint32_t j, off;
+	struct list_head *nh;
+
+	n = sp->nobjs;
+
+	/* The slab->p must be a single slab for subpage allocations. */
+	assert(sl->p + sl->colour <= p && p < sl->p + SLUB_SLAB_SIZE);
+
+	/* The pointer p must be at the start of an object. */
+	off = p - sl->p - sl->colour;
+	j = (off * sp->recip) >> SLUB_RECIP_SHIFT;
+	assert(j < (uint32_t)n && j * sp->sz == off);
+
+	/* Save the current free into the newly freed object,
+	 * and set the newly freed object as s->free.
+	 */
+	*(uint32_t *)p = sl->free;
+	sl->free = j;
+
+	++sl->nfree;
+	assert(sl->nfree <= n);
+	nh = NULL;
+
+	if (sl->nfree == n) {
+		nh = &sp->free;	/* from part. */
+		++sp->nfree_slabs;
+	} else if (sl->nfree == 1) {
+		nh = &sp->part;	/* from full. */
+		--sp->nbusy_slabs;
+	}
+
+	if (nh) {
+		list_del(&sl->entry);
+		list_add(&sl->entry, nh);
+	}
+}
+
+/* Returns n objects under a single acquisition of the class lock. */
+static void kfree_subpages_batch(struct subpage *sp, int n, void **objs)
+{
+	int i;
+	const struct slub_va *v;
+	struct list_head h;
+
+	init_list_head(&h);
+	mutex_lock(&sp->lock);
+	for (i = 0; i < n; ++i) {
+		v = slub_va_get(objs[i]);
+		assert(v && v->sl && v->size == slub_size_of(sp));
+		_kfree_subpages(objs[i], sp, v->sl);
+	}
+
+	if (sp->nfree_slabs > SLUB_FREE_HIGH && sp != &mmu_pt_subpages)
+		slub_trim(sp, SLUB_FREE_LOW, &h);
+	mutex_unlock(&sp->lock);
+
+	slub_release(&h);
+}
+
+/* The large sizes batch no more than a slab page of objects, and hold up
+ * to two batches in their magazine.
+ */
+static int slub_mag_batch(int i)
+{
+	int n;
+
+	n = subpages[i].nobjs;
+	if (n > SLUB_MAG_BATCH)
+		n = SLUB_MAG_BATCH;
+	return n;
+}
+
+/* Called with preemption disabled, for n objects of the subpage size i
+ * asked for with the size sz.
+ */
+static void slub_stats_alloc(int i, size_t sz, int n)
+{
+	struct slub_stats *st;
+
+	st = &slub_stats[i];
+	st->nalloc += n;
+	st->nwaste += n;
+	st->waste += (subpages[i].sz - sz) * n;
+	if (st->nwaste >= SLUB_STATS_DECAY) {
+		st->nwaste >>= 1;
+		st->waste >>= 1;
+	}
+}
+
+/* The magazine is the fast path of the subpage sizes. The batch is carved
+ * with preemption enabled, as the class lock can sleep. If the magazine
+ * filled up meanwhile, the surplus goes back to the slabs.
+ */
+static void *kmalloc_subpages_mag(int i, size_t sz)
+{
+	int j, nb;
+	void *p, *objs[SLUB_MAG_BATCH];
+	struct slub_mag *m;
+
+	m = &slub_mags[i];
+	preempt_disable();
+	slub_stats_alloc(i, sz, 1);
+	if (m->n) {
+		p = m->objs[--m->n];
+		preempt_enable();
+		return p;
+	}
+	preempt_enable();
+
+	nb = slub_mag_batch(i);
+	kmalloc_subpages_batch(&subpages[i], nb, objs);
+
+	preempt_disable();
+	for (j = 1; j < nb && m->n < (nb << 1); ++j)
+		m->objs[m->n++] = objs[j];
+	preempt_enable();
+
+	if (j < nb)
+		kfree_subpages_batch(&subpages[i], nb - j, &objs[j]);
+	return objs[0];
+}
+
+/* O(1): with 2^k < sz <= 2^(k + 1), sz fits either the size 2^(k + 1), or
+ * the size 3 * 2^(k - 1) just below it, when there is one.
+ */
+static int slub_size(size_t sz)
+{
+	int i, k;
+
+	if (sz <= 8)
+		return 0;
+
+	k = 31 - bits_clz(sz - 1);
+	if (k >= PAGE_SIZE_SZ - 1)
+		return SLUB_SUBPAGE_NSIZES + k + 1 - PAGE_SIZE_SZ;
+
+	i = slub_pow2_sizes[k + 1 - 3];
+	if (i - slub_pow2_sizes[k - 3] == 2 && sz <= (3u << (k - 1)))
+		--i;
+	return i;
+}
+
 void *kmalloc(size_t sz)
 {
 	int i;
@@ -389,110 +1109,357 @@ void *kmalloc(size_t sz)
 	if (sz == 0)
 		return NULL;
 
-	for (i = 0; i < SLUB_NSIZES; ++i)
-		if ((1u << (SLUB_SUBPAGE_START + i)) >= sz)
-			break;
-
+	i = slub_size(sz);
 	assert (i < SLUB_NSIZES);
 
 	if (i >= SLUB_SUBPAGE_NSIZES)
 		return kmalloc_fullpages(&fullpages[i - SLUB_SUBPAGE_NSIZES]);
 	else
-		return kmalloc_subpages(&subpages[i]);
+		return kmalloc_subpages_mag(i, sz);
 }
 
-void kfree_fullpages(void *p, struct fullpage *fp, struct page *pg,
-		     uintptr_t pa, struct fullpage_slab *sl)
+/* The subpage sizes bypass the magazine, and carve all n objects under a
+ * single acquisition of the class lock.
+ */
+void kmalloc_bulk(size_t sz, int n, void **objs)
 {
-	int ret;
-	(void)fp;
-	(void)pg;
+	int i, j;
+
+	assert(sz);
+	i = slub_size(sz);
+	assert (i < SLUB_NSIZES);
+
+	if (i < SLUB_SUBPAGE_NSIZES) {
+		kmalloc_subpages_batch(&subpages[i], n, objs);
+		preempt_disable();
+		slub_stats_alloc(i, sz, n);
+		preempt_enable();
+		return;
+	}
+
+	for (j = 0; j < n; ++j)
+		objs[j] = kmalloc_fullpages(&fullpages[i - SLUB_SUBPAGE_NSIZES]);
+}
+
+/* kmalloc_atomic() neither sleeps nor carves slabs; it only takes from the
+ * reserve of the size. When a reserve runs low, a sched IRQ wakes the
+ * refill thread, which tops all the reserves up at _ctx_proc. The reserves
+ * are shared with soft IRQs, so they are guarded with IRQs disabled.
+ */
+_ctx_sched
+static int slub_rsv_irq_sched(void *data)
+{
+	(void)data;
+	wake_up_preempt_disabled(&slub_rsv_wq);
+	return 0;
+}
+
+/* Only the refill thread adds to the reserves, so the space it sees free
+ * cannot shrink before it adds the objects.
+ */
+_ctx_proc
+static void slub_rsv_fill()
+{
+	int i, j, n;
+	void *objs[SLUB_RSV_SZ];
+	struct slub_rsv *r;
+
+	for (i = 0; i < SLUB_SUBPAGE_NSIZES; ++i) {
+		r = &slub_rsvs[i];
+		n = SLUB_RSV_SZ - *(volatile int *)&r->n;
+		if (n == 0)
+			continue;
+
+		kmalloc_subpages_batch(&subpages[i], n, objs);
+
+		irq_disable();
+		for (j = 0; j < n; ++j)
+			r->objs[r->n++] = objs[j];
+		irq_enable();
+	}
+}
+
+_ctx_proc
+static int slub_rsv_thread(void *p)
+{
+	(void)p;
+	while (1) {
+		wait_event(&slub_rsv_wq, slub_rsv_cond == 1);
+		slub_rsv_cond = 0;
+		slub_rsv_fill();
+	}
+	return 0;
+}
+
+/* Returns NULL if the reserve of the size is empty. Only the subpage sizes
+ * have reserves. The object is freed with kfree(), at _ctx_proc.
+ */
+_ctx_soft
+_ctx_sched
+void *kmalloc_atomic(size_t sz)
+{
+	int i;
+	void *p;
+	struct slub_rsv *r;
+
+	if (sz == 0)
+		return NULL;
+
+	i = slub_size(sz);
+	if (i >= SLUB_SUBPAGE_NSIZES)
+		return NULL;
+	r = &slub_rsvs[i];
+
+	p = NULL;
+	irq_disable();
+	if (r->n) {
+		p = r->objs[--r->n];
+		++r->nalloc;
+	}
+	if (r->n < SLUB_RSV_LOW && slub_rsv_cond == 0) {
+		slub_rsv_cond = 1;
+		irq_sched_raise(IRQ_SCHED_SLUB);
+	}
+	irq_enable();
+	return p;
+}
 
+static void kfree_fullpages(void *p, struct fullpage *fp,
+			    struct fullpage_slab *sl)
+{
+	int i, ret, nblks, nmap;
+	enum pm_alloc_units unit;
+	enum mmu_map_unit mu;
+	uintptr_t pas[SLUB_FULLPAGE_NBLKS];
+
+	assert(sl->p == p);
+	slub_va_set(p, NULL, 0);
+
+	mutex_lock(&fp->lock);
 	list_del(&sl->entry);
-	kfree(sl);
+	++slub_stats[SLUB_SUBPAGE_NSIZES + (fp - fullpages)].nfree;
+	mutex_unlock(&fp->lock);
 
-	ret = pm_ram_free(PM_UNIT_PAGE, PGF_USE_SLUB, 1, &pa);
+	slub_fullpage_units(fp, &unit, &nblks);
+	mu = slub_map_unit(unit);
+	nmap = 1 << (unit - slub_map_units[mu]);
+
+	pas[0] = sl->pa;
+	kmem_cache_free(fullpage_slab_cache, sl);
+	for (i = 1; i < nblks; ++i) {
+		pas[i] = mmu_va_to_pa(p + (i << (unit + PAGE_SIZE_SZ)));
+		assert(pas[i] != 0xffffffff);
+	}
+
+	for (i = 0; i < nblks; ++i)
+		slub_map(p + (i << (unit + PAGE_SIZE_SZ)), pas[i], mu, nmap, 0);
+
+	ret = pm_ram_free(unit, PGF_USE_SLUB, nblks, pas);
 	assert(ret == 0);
 
-	ret = vm_free(VMA_SLUB, VM_UNIT_PAGE, 1, (const void **)&p);
+	ret = vm_free(slub_fullpage_area(fp), fp->log_sz - PAGE_SIZE_SZ, 1,
+		      (const void **)&p);
 	assert(ret == 0);
 }
 
-void kfree_subpages(void *p, struct subpage *sp, struct page *pg, uintptr_t pa,
-		     struct subpage_slab *sl)
+/* A full magazine gives a batch, p included, back to the slabs. */
+static void kfree_subpages_mag(void *p, int i)
 {
-	int j, n;
-	struct list_head *nh;
+	int j, nb;
+	void *objs[SLUB_MAG_BATCH];
+	struct slub_mag *m;
+
+	m = &slub_mags[i];
+	nb = slub_mag_batch(i);
+	preempt_disable();
+	++slub_stats[i].nfree;
+	if (m->n < (nb << 1)) {
+		m->objs[m->n++] = p;
+		preempt_enable();
+		return;
+	}
 
-	(void)pa;
+	objs[0] = p;
+	for (j = 1; j < nb; ++j)
+		objs[j] = m->objs[--m->n];
+	preempt_enable();
 
-	/* subpage allocations occur in PAGE_SIZE pages. */
-	assert(bits_get(pg->flags, PGF_UNIT) == PM_UNIT_PAGE);
+	kfree_subpages_batch(&subpages[i], nb, objs);
+}
 
-	n = PAGE_SIZE >> sp->log_sz;
+void kfree(void *p)
+{
+	int i;
+	uint32_t off;
+	const struct slub_va *v;
+	const struct subpage *sp;
+	const struct subpage_slab *sl;
 
-	/* The pointer p must be appropriately aligned. */
-	assert(((uintptr_t)p & ((1 << sp->log_sz) - 1)) == 0);
+	v = slub_va_get(p);
+	assert(v && v->sl);
 
-	sp = &subpages[sp->log_sz - SLUB_SUBPAGE_START];
-	mutex_lock(&sp->lock);
-	/* The slab->p must be a single page for subpage allocations. */
-	assert(sl->p <= p && p < sl->p + PAGE_SIZE);
+	i = v->size;
+	assert(i < SLUB_NSIZES);
 
-	j = p - sl->p;
-	j >>= sp->log_sz;
-	assert(j < n);
+	if (i >= SLUB_SUBPAGE_NSIZES) {
+		kfree_fullpages(p, &fullpages[i - SLUB_SUBPAGE_NSIZES], v->sl);
+		return;
+	}
 
-	/* Save the current free into the newly freed object,
-	 * and set the newly freed object as s->free.
+	/* The pointer p must be at the start of an object, before it goes
+	 * into the magazine.
 	 */
-	*(uint32_t *)p = sl->free;
-	sl->free = j;
+	sp = &subpages[i];
+	sl = v->sl;
+	off = (uintptr_t)p & SLUB_SLAB_SIZE_MASK;
+	assert(off >= sl->colour);
+	off -= sl->colour;
+	assert(((off * sp->recip) >> SLUB_RECIP_SHIFT) * sp->sz == off);
+	kfree_subpages_mag(p, i);
+}
 
-	++sl->nfree;
-	assert(sl->nfree <= n);
-	nh = NULL;
+/* Each run of objects of the same subpage size goes back under a single
+ * acquisition of the class lock.
+ */
+void kfree_bulk(int n, void **objs)
+{
+	int i, j;
+	const struct slub_va *v, *w;
+
+	for (i = 0; i < n; i = j) {
+		v = slub_va_get(objs[i]);
+		assert(v && v->sl && v->size < SLUB_NSIZES);
+
+		if (v->size >= SLUB_SUBPAGE_NSIZES) {
+			kfree(objs[i]);
+			j = i + 1;
+			continue;
+		}
+
+		for (j = i + 1; j < n; ++j) {
+			w = slub_va_get(objs[j]);
+			if (w == NULL || w->size != v->size)
+				break;
+		}
+		kfree_subpages_batch(&subpages[v->size], j - i, &objs[i]);
+		preempt_disable();
+		slub_stats[v->size].nfree += j - i;
+		preempt_enable();
+	}
+}
 
-	if (sl->nfree == n)
-		nh = &sp->free;	/* from part. */
-	else if (sl->nfree == 1)
-		nh = &sp->part;	/* from full. */
+/* One row per size: the slabs, the objects in the magazine, the objects in
+ * use, and the average waste of the recent allocations, in 1/1000ths of
+ * the size. The fullpage sizes only count the objects in use. All the
+ * numbers are in hex.
+ */
+_ctx_proc
+void slub_stats_dump()
+{
+	int i, nslabs, nbusy, nfree;
+	uint32_t inuse, waste;
+	struct subpage *sp;
+	struct slub_stats *st;
 
-	if (nh) {
-		list_del(&sl->entry);
-		list_add(&sl->entry, nh);
+	uart_send_str("slub size nslabs busy part free mag inuse waste\r\n");
+	for (i = 0; i < SLUB_SUBPAGE_NSIZES; ++i) {
+		sp = &subpages[i];
+		st = &slub_stats[i];
+
+		mutex_lock(&sp->lock);
+		nslabs = sp->nslabs;
+		nbusy = sp->nbusy_slabs;
+		nfree = sp->nfree_slabs;
+		mutex_unlock(&sp->lock);
+
+		preempt_disable();
+		inuse = st->nalloc + slub_rsvs[i].nalloc - st->nfree;
+		waste = st->nwaste ? (st->waste << 4) / st->nwaste : 0;
+		preempt_enable();
+		waste = waste * 1000 / (sp->sz << 4);
+
+		uart_send_hex(sp->sz);
+		uart_send(' ');
+		uart_send_hex(nslabs);
+		uart_send(' ');
+		uart_send_hex(nbusy);
+		uart_send(' ');
+		uart_send_hex(nslabs - nbusy - nfree);
+		uart_send(' ');
+		uart_send_hex(nfree);
+		uart_send(' ');
+		uart_send_hex(slub_mags[i].n);
+		uart_send(' ');
+		uart_send_hex(inuse);
+		uart_send(' ');
+		uart_send_num(waste);
+	}
+
+	uart_send_str("slub size inuse\r\n");
+	for (i = SLUB_SUBPAGE_NSIZES; i < SLUB_NSIZES; ++i) {
+		st = &slub_stats[i];
+		uart_send_hex(1 << fullpages[i - SLUB_SUBPAGE_NSIZES].log_sz);
+		uart_send(' ');
+		uart_send_num(st->nalloc - st->nfree);
 	}
-	mutex_unlock(&sp->lock);
 }
 
-void kfree(void *p)
+/* Empties the magazines into the slabs, and gives back every free slab.
+ * Runs in the compaction thread, with no locks held.
+ */
+_ctx_proc
+static int slub_shrink(struct pm_shrinker *s)
 {
-	int i;
-	void *va;
-	uintptr_t pa;
-	struct page *pg;
+	int i, n, ret;
+	void *objs[SLUB_MAG_SZ];
+	struct slub_mag *m;
+	struct subpage *sp;
+	struct list_head h;
 
-	/* The struct page for the pointer p must have SLUB_LEADER set in va,
-	 * and PGF_USE_SLUB set in flags.
-	 */
-	pa = mmu_va_to_pa(p);
-	assert(pa != 0xffffffff);
+	(void)s;
 
-	pg = pm_ram_get_page(pa);
-	assert(bits_get(pg->flags, PGF_USE) == PGF_USE_SLUB);
+	ret = 0;
+	init_list_head(&h);
+	for (i = 0; i < SLUB_SUBPAGE_NSIZES; ++i) {
+		sp = &subpages[i];
+		m = &slub_mags[i];
 
-	va = pg->u0.va;
-	assert(bits_get((uintptr_t)va, SLUB_LEADER));
-	va = (void *)((uintptr_t)va & bits_off(SLUB_LEADER));
+		preempt_disable();
+		n = m->n;
+		memcpy(objs, m->objs, n * sizeof(objs[0]));
+		m->n = 0;
+		preempt_enable();
 
-	i = bits_get(pg->flags, PGF_SLUB_LSIZE) - SLUB_SUBPAGE_START;
+		if (n)
+			kfree_subpages_batch(sp, n, objs);
 
-	if (i >= SLUB_SUBPAGE_NSIZES)
-		kfree_fullpages(p, &fullpages[i - SLUB_SUBPAGE_NSIZES], pg, pa,
-				(struct fullpage_slab *)va);
-	else
-		kfree_subpages(p, &subpages[i], pg, pa,
-			       (struct subpage_slab *)va);
+		mutex_lock(&sp->lock);
+		slub_trim(sp, 0, &h);
+		mutex_unlock(&sp->lock);
+
+		ret += slub_release(&h);
+	}
+	return ret;
+}
+
+_ctx_init
+void slub_shrinker_init()
+{
+	slub_shrinker.shrink = slub_shrink;
+	pm_shrinker_register(&slub_shrinker);
+}
+
+/* Needs the scheduler, for the refill thread. */
+_ctx_init
+void slub_rsv_init()
+{
+	struct thread *t;
+
+	init_list_head(&slub_rsv_wq);
+	slub_rsv_fill();
+	irq_sched_insert(IRQ_SCHED_SLUB, slub_rsv_irq_sched, NULL);
+	t = sched_thread_create(slub_rsv_thread, NULL);
+	assert(t);
 }
 
 void *mmu_slub_alloc()
@@ -502,26 +1469,12 @@ void *mmu_slub_alloc()
 
 void mmu_slub_free(void *p)
 {
-	int i;
-	void *va;
-	uintptr_t pa;
-	struct page *pg;
-	/* The struct page for the pointer p must have SLUB_LEADER set in va,
-	 * and PGF_USE_SLUB set in flags.
-	 */
-	pa = mmu_va_to_pa(p);
-	assert(pa != 0xffffffff);
-
-	pg = pm_ram_get_page(pa);
-	assert(bits_get(pg->flags, PGF_USE) == PGF_USE_SLUB);
+	const struct slub_va *v;
 
-	va = pg->u0.va;
-	assert(bits_get((uintptr_t)va, SLUB_LEADER));
-	va = (void *)((uintptr_t)va & bits_off(SLUB_LEADER));
-
-	i = bits_get(pg->flags, PGF_SLUB_LSIZE);
-	assert(i == 10);
-	kfree_subpages(p, &mmu_pt_subpages, pg, pa, (struct subpage_slab *)va);
+	v = slub_va_get(p);
+	assert(v && v->sl);
+	assert(v->size == SLUB_SIZE_PT);
+	kfree_subpages_batch(&mmu_pt_subpages, 1, &p);
 }
 
 /* pa must be appropriately aligned.
@@ -547,6 +1500,6 @@ void *mmu_slub_pa_to_va(uintptr_t pa)
 
 	sl = (const struct subpage_slab *)va;
 
-	return sl->p + (pa & PAGE_SIZE_MASK);
+	return sl->p + (pa - sl->pa);
 }
 
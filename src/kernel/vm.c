@@ -16,139 +16,151 @@
  */
 
 #include <assert.h>
+#include <bdy.h>
 #include <mmu.h>
-#include <slub.h>
-#include <string.h>
 #include <vm.h>
 #include <mutex.h>
 
 #include <sys/vm.h>
 
 extern char vm_slub_start;
+extern char vm_slub_section_start;
 
 /* Same order as enum vm_area. */
 static void *vm_area_start[] = {
 	&vm_slub_start,
+	&vm_slub_section_start,
 };
 
-static struct list_head vm_areas[VMA_MAX];
+/* The unit of the buddy of each area. VMA_SLUB_SECTION only ever hands
+ * out sections and larger, so that its 64MB blocks fit the buddy levels.
+ */
+static const enum vm_alloc_units vm_area_unit[] = {
+	VM_UNIT_PAGE,
+	VM_UNIT_SECTION,
+};
+
+#define VM_AREA_NPAGES		(VM_AREA_SIZE >> PAGE_SIZE_SZ)
+
+/* An upper bound of bdy_map_size() for n units, in limbs. Over all the
+ * levels, the busy bitmaps take under n >> 4 limbs and the first summary
+ * tiers under n >> 9; each tier rounds up by at most a limb.
+ */
+#define VM_MAP_NLIMBS(n)	(((n) >> 4) + ((n) >> 9) + 3 * BDY_NLEVELS)
+
+static uint32_t vm_slub_map[VM_MAP_NLIMBS(VM_AREA_NPAGES)];
+static uint32_t vm_slub_section_map[VM_MAP_NLIMBS(VM_AREA_NPAGES >>
+						  VM_UNIT_SECTION)];
+
+static void *vm_maps[] = {
+	vm_slub_map,
+	vm_slub_section_map,
+};
+
+static const size_t vm_map_sizes[] = {
+	sizeof(vm_slub_map),
+	sizeof(vm_slub_section_map),
+};
+
+/* Each area is a buddy bitmap of its units, so that finding and freeing
+ * a naturally aligned block costs O(levels), however many are in use.
+ */
+static struct bdy vm_areas[VMA_MAX];
 static struct mutex vm_areas_lock[VMA_MAX];
 
 void vm_init()
 {
-	int i;
-	struct vm_seg *slabs;
-	extern char vm_slub_end;
+	int i, n, ret, level;
 
 	for (i = 0; i < VMA_MAX; ++i) {
-		init_list_head(&vm_areas[i]);
+		n = VM_AREA_NPAGES >> vm_area_unit[i];
+		assert(bdy_map_size(BDY_TYPE_BITMAP, n) <= vm_map_sizes[i]);
+		bdy_init(&vm_areas[i], BDY_TYPE_BITMAP, vm_maps[i], n);
 		mutex_init(&vm_areas_lock[i]);
 	}
 
-	/* The last 9 pages of vm_slub area are utilized as slabs. */
-	slabs = kmalloc(sizeof(*slabs));
-	memset(slabs, 0, sizeof(*slabs));
+	/* The last pages of vm_slub area are utilized as slabs. They are
+	 * reserved one slab each, so that slub can give them back.
+	 */
+	level = VM_SLUB_BOOT_UNIT - vm_area_unit[VMA_SLUB];
+	n = VM_AREA_NPAGES >> VM_SLUB_BOOT_UNIT;
+	for (i = n - VM_SLUB_NBOOT; i < n; ++i) {
+		ret = bdy_reserve(&vm_areas[VMA_SLUB], level, i);
+		assert(ret == 0);
+	}
+}
 
-	slabs->start = &vm_slub_end - (9 << PAGE_SIZE_SZ);;
-	slabs->flags |= bits_set(VSF_NPAGES, 9);
+/* The buddy level of the unit within the area. */
+static int vm_level(enum vm_area area, enum vm_alloc_units unit)
+{
+	int level;
 
-	list_add(&slabs->entry, &vm_areas[VMA_SLUB]);
+	assert(area < VMA_MAX);
+	level = unit - vm_area_unit[area];
+	assert(level >= 0 && level < BDY_NLEVELS);
+	return level;
 }
 
-static const struct vm_seg *vm_find_seg(struct list_head *area,
-					const void *start,
-					const void *end)
+/* The VA of the block pos of the level. */
+static void *vm_va(enum vm_area area, enum vm_alloc_units unit, int pos)
 {
-	void *send;
-	struct list_head *e;
-	struct vm_seg *seg;
-
-	list_for_each_rev(e, area) {
-		seg = list_entry(e, struct vm_seg, entry);
-		send = seg->start + bits_pull(seg->flags, VSF_NPAGES);
-		if (seg->start <= start && start < send)
-			return seg;
-		if (seg->start < end && end <= send)
-			return seg;
-		if (start <= seg->start && seg->start < end)
-			return seg;
-		if (start < send && send <= end)
-			return seg;
-	}
-
-	return NULL;
+	return vm_area_start[area] + ((uintptr_t)pos << (PAGE_SIZE_SZ + unit));
 }
 
-static void *vm_find_free(enum vm_area area,
-			  enum vm_alloc_units unit)
+static int vm_pos(enum vm_area area, enum vm_alloc_units unit, const void *va)
 {
-	void *as, *ae, *t;
-	size_t align;
-
-	as = vm_area_start[area];
-	ae = as + VM_AREA_SIZE;
-	align = PAGE_SIZE << unit;
-	t = ae - align;
-
-	for (t = t; t >= as; t -= align) {
-		if (vm_find_seg(&vm_areas[area], t, t + align))
-			continue;
-		return t;
-	}
-	return NULL;
+	uintptr_t off;
+
+	off = va - vm_area_start[area];
+	assert(off < VM_AREA_SIZE);
+	assert(ALIGNED(off, (uintptr_t)1 << (PAGE_SIZE_SZ + unit)));
+	return off >> (PAGE_SIZE_SZ + unit);
 }
 
+/* All or nothing. */
 int vm_alloc(enum vm_area area, enum vm_alloc_units unit, int n,
 	     void **va)
 {
-	int i;
-	struct vm_seg *seg;
+	int i, ret, level, pos;
+	struct bdy *b;
 
-	assert(area < VMA_MAX);
-
-	/* Search for naturally aligned and sized block of free virtual
-	 * memory
-	 */
+	level = vm_level(area, unit);
+	b = &vm_areas[area];
 
+	ret = 0;
 	mutex_lock(&vm_areas_lock[area]);
 	for (i = 0; i < n; ++i) {
-		va[i] = vm_find_free(area, unit);
-		assert(va[i]);
-		seg = kmalloc(sizeof(*seg));
-		seg->start = va[i];
-		seg->flags = bits_set(VSF_NPAGES, 1u << unit);
-		list_add(&seg->entry, &vm_areas[area]);
+		ret = bdy_alloc(b, level, 1, &pos);
+		if (ret)
+			break;
+		va[i] = vm_va(area, unit, pos);
 	}
-	mutex_unlock(&vm_areas_lock[area]);
 
-	/* TODO free all and return error if at least one allocation
-	 * failed
-	 */
-	return 0;
+	while (ret && i--) {
+		pos = vm_pos(area, unit, va[i]);
+		bdy_free(b, level, 1, &pos);
+	}
+	mutex_unlock(&vm_areas_lock[area]);
+	return ret;
 }
 
 int vm_free(enum vm_area area, enum vm_alloc_units unit, int n,
 	    const void **va)
 {
-	int i;
-	struct list_head *e;
-	struct vm_seg *seg;
+	int i, ret, level, pos;
+	struct bdy *b;
+
+	level = vm_level(area, unit);
+	b = &vm_areas[area];
 
-	assert(area < VMA_MAX);
 	mutex_lock(&vm_areas_lock[area]);
-	list_for_each(e, &vm_areas[area]) {
-		seg = list_entry(e, struct vm_seg, entry);
-		for (i = 0; i < n; ++i) {
-			if (va[i] == NULL)
-				continue;
-			if (seg->start != va[i])
-				continue;
-			assert(bits_get(seg->flags, VSF_NPAGES) ==
-			       (1u << unit));
-			list_del(&seg->entry);
-			kfree(seg);
-			va[i] = NULL;
-		}
+	for (i = 0; i < n; ++i) {
+		pos = vm_pos(area, unit, va[i]);
+
+		/* A busy block has its first unit busy. */
+		assert(!bdy_is_free(b, pos << level));
+		ret = bdy_free(b, level, 1, &pos);
+		assert(ret == 0);
 	}
 	mutex_unlock(&vm_areas_lock[area]);
 	return 0;